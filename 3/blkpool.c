@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "blkpool.h"
+#include "config.h"
+
+#define ARENA_ALIGN (2u << 20)
+
+typedef struct blkpool_free {
+    struct blkpool_free *next;
+} blkpool_free_t;
+
+typedef struct blkpool_arena {
+    void *base;
+    size_t len;
+    struct blkpool_arena *next;
+} blkpool_arena_t;
+
+/* Each thread keeps a short free list for the pool it last used; blocks
+   move to and from the shared lists in batches, so the common alloc/free
+   pair never touches the pool mutex. */
+typedef struct {
+    blkpool_t *pool;
+    blkpool_free_t *head;
+    size_t n;
+} tcache_t;
+
+static __thread tcache_t tc;
+static pthread_key_t tc_key;
+static pthread_once_t tc_once = PTHREAD_ONCE_INIT;
+
+static void tc_flush(tcache_t *t, size_t keep) {
+    if (t->n <= keep)
+        return;
+    blkpool_free_t *first = t->head, *last = first;
+    size_t n = t->n - keep;
+    for (size_t i = 1; i < n; i++)
+        last = last->next;
+    t->head = last->next;
+    t->n = keep;
+
+    blkpool_t *p = t->pool;
+    pthread_mutex_lock(&p->m);
+    last->next = p->hot;
+    p->hot = first;
+    p->nhot += n;
+    pthread_mutex_unlock(&p->m);
+}
+
+static void tc_exit(void *arg) {
+    tcache_t *t = arg;
+    if (t->pool)
+        tc_flush(t, 0);
+    t->pool = NULL;
+}
+
+static void tc_key_init(void) {
+    pthread_key_create(&tc_key, tc_exit);
+}
+
+static tcache_t *tc_get(blkpool_t *p) {
+    if (tc.pool == p)
+        return &tc;
+    if (tc.pool)
+        tc_flush(&tc, 0);
+    pthread_once(&tc_once, tc_key_init);
+    pthread_setspecific(tc_key, &tc);
+    tc.pool = p;
+    return &tc;
+}
+
+static int arena_map(blkpool_t *p) {
+    size_t len = (size_t) BLKPOOL_ARENA_BLOCKS * p->block_sz;
+    len = (len + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    blkpool_arena_t *a = malloc(sizeof *a);
+    if (!a)
+        return -1;
+    // over-map and trim so the arena is huge-page aligned
+    char *raw = mmap(NULL, len + ARENA_ALIGN, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        free(a);
+        return -1;
+    }
+    char *base = (char *) (((uintptr_t) raw + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1));
+    if (base > raw)
+        munmap(raw, (size_t) (base - raw));
+    munmap(base + len, (size_t) (raw + ARENA_ALIGN - base));
+    if (BLKPOOL_THP)
+        madvise(base, len, MADV_HUGEPAGE);
+
+    a->base = base;
+    a->len = len;
+    a->next = p->arenas;
+    p->arenas = a;
+    p->carve = base;
+    p->carve_end = base + len;
+    __atomic_add_fetch(&p->mapped, len, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static blkpool_free_t *pool_take(blkpool_t *p) {
+    blkpool_free_t *b;
+    if ((b = p->hot)) {
+        p->hot = b->next;
+        p->nhot--;
+    } else if (p->ncold) {
+        b = p->cold[--p->ncold];
+        __atomic_sub_fetch(&p->released, p->block_sz, __ATOMIC_RELAXED);
+    } else if (p->carve + p->block_sz <= p->carve_end || arena_map(p) == 0) {
+        b = (blkpool_free_t *) p->carve;
+        p->carve += p->block_sz;
+    }
+    return b;
+}
+
+int blkpool_init(blkpool_t *p, size_t block_sz) {
+    if (block_sz < sizeof(blkpool_free_t) || ARENA_ALIGN % block_sz)
+        return -1;
+    pthread_mutex_init(&p->m, NULL);
+    p->block_sz = block_sz;
+    p->arenas = NULL;
+    p->carve = p->carve_end = NULL;
+    p->hot = NULL;
+    p->cold = NULL;
+    p->nhot = p->ncold = p->cold_cap = 0;
+    p->mapped = p->released = 0;
+    return 0;
+}
+
+void blkpool_destroy(blkpool_t *p) {
+    if (tc.pool == p) {
+        tc.pool = NULL;
+        tc.head = NULL;
+        tc.n = 0;
+    }
+    blkpool_arena_t *a = p->arenas;
+    while (a) {
+        blkpool_arena_t *n = a->next;
+        munmap(a->base, a->len);
+        free(a);
+        a = n;
+    }
+    p->arenas = NULL;
+    free(p->cold);
+    p->cold = NULL;
+    pthread_mutex_destroy(&p->m);
+}
+
+void *blkpool_alloc(blkpool_t *p) {
+    tcache_t *t = tc_get(p);
+    if (!t->head) {
+        pthread_mutex_lock(&p->m);
+        while (t->n < BLKPOOL_BATCH) {
+            blkpool_free_t *b = pool_take(p);
+            if (!b)
+                break;
+            b->next = t->head;
+            t->head = b;
+            t->n++;
+        }
+        pthread_mutex_unlock(&p->m);
+        if (!t->head)
+            return NULL;
+    }
+    blkpool_free_t *b = t->head;
+    t->head = b->next;
+    t->n--;
+    return b;
+}
+
+void blkpool_free(blkpool_t *p, void *ptr) {
+    if (!ptr)
+        return;
+    tcache_t *t = tc_get(p);
+    blkpool_free_t *b = ptr;
+    b->next = t->head;
+    t->head = b;
+    if (++t->n > BLKPOOL_TCACHE)
+        tc_flush(t, BLKPOOL_TCACHE - BLKPOOL_BATCH);
+}
+
+/* Free blocks beyond keep bytes give their pages back to the kernel but
+   stay on a cold stack, so the address space is reused rather than
+   remapped. The stack lives outside the blocks so that releasing them
+   does not fault a page back in for the link. */
+void blkpool_trim(blkpool_t *p, size_t keep) {
+    size_t keep_blocks = keep / p->block_sz;
+    pthread_mutex_lock(&p->m);
+    while (p->nhot > keep_blocks) {
+        if (p->ncold == p->cold_cap) {
+            size_t nc = p->cold_cap ? p->cold_cap * 2 : 256;
+            void **ncold = realloc(p->cold, nc * sizeof *ncold);
+            if (!ncold)
+                break;
+            p->cold = ncold;
+            p->cold_cap = nc;
+        }
+        blkpool_free_t *b = p->hot;
+        p->hot = b->next;
+        p->nhot--;
+        madvise(b, p->block_sz, MADV_DONTNEED);
+        p->cold[p->ncold++] = b;
+        __atomic_add_fetch(&p->released, p->block_sz, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&p->m);
+}
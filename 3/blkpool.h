@@ -0,0 +1,22 @@
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+
+typedef struct blkpool {
+    pthread_mutex_t m;
+    size_t block_sz;
+    struct blkpool_arena *arenas;
+    char *carve, *carve_end;
+    struct blkpool_free *hot;
+    void **cold;
+    size_t nhot, ncold, cold_cap;
+
+    volatile size_t mapped, released;
+} blkpool_t;
+
+int  blkpool_init(blkpool_t *p, size_t block_sz);
+void blkpool_destroy(blkpool_t *p);
+
+void *blkpool_alloc(blkpool_t *p);
+void  blkpool_free(blkpool_t *p, void *b);
+void  blkpool_trim(blkpool_t *p, size_t keep);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "cache.h"
 #include "config.h"
 #include <string.h>
@@ -5,174 +6,373 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
 #include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 typedef struct block {
-    size_t used;
     char  data[BLOCK_SZ];
 } block_t;
 
-struct record {
-    char *key;
-    uint64_t h;
+typedef struct seg {
+    char *p;
+    size_t sz;
+} seg_t;
 
-    pthread_mutex_t m;
-    pthread_cond_t  updated;
-    block_t **blocks;
-    size_t nblocks, capblocks;
-    size_t total;
-    int completed, canceled;
-    int has_fetcher;
+typedef struct blkvec {
+    size_t cap;
+    struct blkvec *prev;
+    seg_t s[];
+} blkvec_t;
 
-    int keep_on_complete; 
-    size_t declared_length; 
+/* The first 48 bytes are all a reader touches: the completion flags,
+   the published length and what maps an offset to its bytes. Fields
+   the fetcher owns under lk come next, then the policy's. */
+struct record {
+    _Atomic uint32_t st;
+    atomic_int refcnt;
+    atomic_size_t total;
+    _Atomic(char *) flat;
+    _Atomic(blkvec_t *) blocks;
+    size_t grow_end;
+    uint32_t first;
+    uint8_t grow_n;
+    _Atomic uint32_t lk;
+    uint32_t nsegs;
 
-    atomic_int refcnt; 
-    int in_lru;
+    uint32_t joiners;
+    uint8_t has_fetcher;
+    uint8_t keep_on_complete;
+    uint8_t region;
+    int fd;
+    size_t covered, charged;
+    size_t declared_length;
+    rec_waiter_t *waiters;
+    rec_tap_t *taps, *tapped;
+    int pass_fd, pass_reuse;
+    size_t pass_left;
+    rec_cursor_t *cursors;
+    _Atomic(rec_waiter_t *) win_waiter;
+    uint32_t nseen, dropped;
+    blkpool_t *pool;
 
+    uint64_t h;
+    size_t klen;
+    atomic_int referenced;
+    atomic_uint freq;
+    uint32_t born_us, cost_us;
+    unsigned pri_freq;
+    uint32_t heap_idx;
+    double pri;
     record_t *prev, *next;
+    record_t *cnext;
 
-    struct entry *e;
+    char inl[REC_INLINE];
+    char key[];
 };
 
-struct entry {
-    uint64_t h;
-    char *key;
-    record_t *rec;
-    struct entry *next;
-};
+enum { RS_DONE = 1, RS_CANCELED = 2, RS_TEE = 4, RS_PASS = 8 };
+
+enum { REG_NONE, REG_WINDOW, REG_MAIN };
+
+// the table takes the low bits and the tag the top ones, so shards use the middle
+static struct cache_shard* shard_of(cache_t *c, uint64_t h){ return &c->shards[(h >> 32) & (c->nshards-1)]; }
+
+static int key_eq(const void *val, const void *key) {
+    const record_t *r = val;
+    const cache_key_t *k = key;
+    return r->klen == k->head_len + k->tail_len &&
+           memcmp(r->key, k->head, k->head_len) == 0 &&
+           memcmp(r->key + k->head_len, k->tail, k->tail_len) == 0;
+}
 
-static struct bucket* bucket_of(cache_t *c, uint64_t h){ return &c->b[h & (c->nbuckets-1)]; }
+static void futex_wait(_Atomic uint32_t *w, uint32_t val) {
+    syscall(SYS_futex, w, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *w, int n) {
+    syscall(SYS_futex, w, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
 
-static uint64_t fnv1a64(const char *s) {
-    uint64_t h=1469598103934665603ULL;
-    for (; *s; ++s) { 
-        h^=(unsigned char)*s; 
-        h*=1099511628211ULL; 
+/* lk is 0 free, 1 held, 2 held with sleepers. */
+static void rec_lock(record_t *r) {
+    uint32_t v = 0;
+    if(atomic_compare_exchange_strong_explicit(&r->lk, &v, 1, memory_order_acquire, memory_order_relaxed))
+        return;
+    if(v != 2)
+        v = atomic_exchange_explicit(&r->lk, 2, memory_order_acquire);
+    while(v) {
+        futex_wait(&r->lk, 2);
+        v = atomic_exchange_explicit(&r->lk, 2, memory_order_acquire);
     }
-    return h;
 }
 
-char *strdup_safe(const char *s) {
-    if(!s) 
-        return NULL; 
-    size_t n = strlen(s) + 1; 
-    char *p=malloc(n); 
-    if(!p) 
-        return NULL; 
-    
-    memcpy(p,s,n); 
+static void rec_unlock(record_t *r) {
+    if(atomic_exchange_explicit(&r->lk, 0, memory_order_release) == 2)
+        futex_wake(&r->lk, 1);
+}
 
-    return p;
+static uint32_t rec_state(record_t *r) {
+    return atomic_load_explicit(&r->st, memory_order_acquire);
+}
+
+/* Called with lk held, after the new bytes or flags are in place. Wakes
+   the waiters, kept sorted by offset, whose offset is below upto. */
+static void rec_wake(record_t *r, size_t upto) {
+    rec_waiter_t *w = r->waiters;
+    while (w && w->at < upto) {
+        rec_waiter_t *n = w->next;
+        w->next = NULL;
+        w->armed = 0;
+        w->wake(w);
+        w = n;
+    }
+    r->waiters = w;
 }
 
-static record_t* rec_create(const char *key, uint64_t h) {
-    record_t *r=calloc(1,sizeof *r); 
+static void tap_fire(rec_tap_t *t) {
+    atomic_store_explicit(&t->fired, 1, memory_order_release);
+    futex_wake(&t->fired, 1);
+}
+
+static void taps_fire(rec_tap_t *t) {
+    while(t) {
+        rec_tap_t *n = t->next;
+        tap_fire(t);
+        t = n;
+    }
+}
+
+/* Only the fetcher settles a record once it runs, so it may hand back
+   the taps it owns here too. */
+static void rec_settle(record_t *r, uint32_t flags) {
+    atomic_fetch_or_explicit(&r->st, flags, memory_order_release);
+    atomic_store_explicit(&r->win_waiter, NULL, memory_order_relaxed);
+    rec_wake(r, SIZE_MAX);
+    taps_fire(r->taps);
+    taps_fire(r->tapped);
+    r->taps = r->tapped = NULL;
+}
+
+static void rec_arm(record_t *r, rec_waiter_t *w, size_t at) {
+    rec_waiter_t **pp = &r->waiters;
+    while (*pp && (*pp)->at <= at)
+        pp = &(*pp)->next;
+    w->at = at;
+    w->armed = 1;
+    w->next = *pp;
+    *pp = w;
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static record_t* rec_create(cache_t *c, const cache_key_t *key) {
+    size_t klen = key->head_len + key->tail_len;
+    record_t *r=calloc(1,sizeof *r + klen + 1); 
     if(!r) 
         return NULL;
     
-    r->key=strdup_safe(key); 
-    r->h=h;
-    pthread_mutex_init(&r->m,NULL);
-    pthread_cond_init(&r->updated,NULL);
+    memcpy(r->key, key->head, key->head_len);
+    memcpy(r->key + key->head_len, key->tail, key->tail_len);
+    r->klen=klen;
+    r->h=key->h;
+    r->pool=&c->pool;
     r->keep_on_complete=1;
+    r->fd=-1;
+    r->pass_fd=-1;
+    r->born_us = (uint32_t)now_us();
 
     atomic_init(&r->refcnt, 1); 
 
     return r;
 }
 
+static void rec_free_segs(record_t *r) {
+    blkvec_t *v = atomic_load_explicit(&r->blocks, memory_order_relaxed);
+    for(size_t i=r->dropped;i<r->nsegs;i++) {
+        if(v->s[i].sz == BLOCK_SZ)
+            blkpool_free(r->pool, v->s[i].p);
+        else
+            free(v->s[i].p);
+    }
+    while(v) {
+        blkvec_t *prev = v->prev;
+        free(v);
+        v = prev;
+    }
+    atomic_store_explicit(&r->blocks, NULL, memory_order_relaxed);
+    r->nsegs = 0;
+}
+
+static void flat_free(char *flat, size_t total, int fd) {
+    if(fd >= 0) {
+        munmap(flat, total);
+        close(fd);
+    } else {
+        free(flat);
+    }
+}
+
 static void rec_free(record_t *r) {
     if(!r) return;
-    for(size_t i=0;i<r->nblocks;i++) free(r->blocks[i]);
-    free(r->blocks);
-    free(r->key);
-    pthread_mutex_destroy(&r->m);
-    pthread_cond_destroy(&r->updated);
+    rec_free_segs(r);
+    char *flat = atomic_load_explicit(&r->flat, memory_order_relaxed);
+    flat_free(flat, rec_size(r), r->fd);
+    if(r->pass_fd >= 0)
+        close(r->pass_fd);
     free(r);
 }
 
-int cache_init(cache_t *c, size_t nbuckets, size_t soft) {
-    if((nbuckets & (nbuckets-1)) != 0) 
+static void *evictor_main(void *arg);
+
+static void shards_free(cache_t *c, size_t n) {
+    for(size_t i = 0; i < n; i++) {
+        htab_destroy(&c->shards[i].t);
+        pthread_mutex_destroy(&c->shards[i].m);
+    }
+    free(c->shards);
+}
+
+int cache_init(cache_t *c, size_t nshards, size_t soft) {
+    if((nshards & (nshards-1)) != 0) 
+        return -1;
+    c->nshards=nshards;
+    c->shards = calloc(nshards, sizeof *c->shards); if(!c->shards) return -1;
+    for(size_t i = 0; i < nshards; i++) {
+        if(htab_init(&c->shards[i].t, INDEX_INIT_GROUPS)) {
+            shards_free(c, i);
+            return -1;
+        }
+        pthread_mutex_init(&c->shards[i].m, NULL);
+    }
+
+    if(sketch_init(&c->sketch, SKETCH_WIDTH)) {
+        shards_free(c, nshards);
+        return -1;
+    }
+    if(blkpool_init(&c->pool, sizeof(block_t))) {
+        sketch_destroy(&c->sketch);
+        shards_free(c, nshards);
         return -1;
-    c->nbuckets=nbuckets;
-    c->b = calloc(nbuckets, sizeof *c->b); if(!c->b) return -1;
-    for(size_t i = 0; i < nbuckets; i++) 
-        pthread_mutex_init(&c->b[i].m, NULL);
+    }
 
-    pthread_mutex_init(&c->lru_m, NULL);
-    c->lru_head = c->lru_tail = NULL;
+    pthread_mutex_init(&c->policy_m, NULL);
+    c->heap = NULL;
+    c->heap_len = c->heap_cap = 0;
+    c->inflation = 0;
+    c->win_head = c->win_tail = NULL;
+    c->window_bytes = 0;
+    c->window_limit = soft / 100 * WINDOW_PCT;
     c->bytes_completed = 0;
+    c->bytes_inflight = 0;
     c->soft_limit = soft;
-    c->hits = c->misses = c->stores = c->evicts = 0;
+    c->low_mark = soft / 100 * EVICT_LOW_PCT;
+    c->hard_limit = soft / 100 * HARD_LIMIT_PCT;
+    c->hits = c->misses = c->stores = c->evicts = c->stalls = 0;
+    c->admits = c->rejects = 0;
+    c->hit_bytes = c->fetch_bytes = 0;
+    c->compact_head = NULL;
+    c->compacted = c->compact_saved = c->compact_files = 0;
+
+    pthread_mutex_init(&c->ev_m, NULL);
+    pthread_cond_init(&c->ev_wake, NULL);
+    pthread_cond_init(&c->ev_done, NULL);
+    c->ev_kicked = c->ev_stop = 0;
+    c->has_evictor = pthread_create(&c->evictor, NULL, evictor_main, c) == 0;
 
     return 0;
 }
-void cache_destroy(cache_t *c) {
-    for(size_t i = 0; i < c->nbuckets; i++) {
-        pthread_mutex_lock(&c->b[i].m);
-        struct entry *e=c->b[i].head;
-        while(e) {
-            struct entry *n=e->next;
-            if(e->rec) 
-                if(atomic_fetch_sub(&e->rec->refcnt,1) == 1) 
-                    rec_free(e->rec);
-
-            free(e->key); free(e);
-            e=n;
-        }
+static void release_val(void *val, void *arg) {
+    (void)arg;
+    cache_release((record_t *)val);
+}
 
-        pthread_mutex_unlock(&c->b[i].m);
-        pthread_mutex_destroy(&c->b[i].m);
+void cache_destroy(cache_t *c) {
+    if(c->has_evictor) {
+        pthread_mutex_lock(&c->ev_m);
+        c->ev_stop = 1;
+        pthread_cond_broadcast(&c->ev_wake);
+        pthread_cond_broadcast(&c->ev_done);
+        pthread_mutex_unlock(&c->ev_m);
+        pthread_join(c->evictor, NULL);
+        c->has_evictor = 0;
+    }
+    while(c->compact_head) {
+        record_t *r = c->compact_head;
+        c->compact_head = r->cnext;
+        cache_release(r);
     }
+    pthread_mutex_destroy(&c->ev_m);
+    pthread_cond_destroy(&c->ev_wake);
+    pthread_cond_destroy(&c->ev_done);
 
-    free(c->b);
-    pthread_mutex_destroy(&c->lru_m);
+    for(size_t i = 0; i < c->nshards; i++)
+        htab_each(&c->shards[i].t, release_val, NULL);
+    shards_free(c, c->nshards);
+    sketch_destroy(&c->sketch);
+    free(c->heap);
+    blkpool_destroy(&c->pool);
+    pthread_mutex_destroy(&c->policy_m);
 }
 
-int cache_acquire(cache_t *c, const char *key, cache_acquire_t *out) {
-    uint64_t h = fnv1a64(key);
-    struct bucket *b=bucket_of(c,h);
-    pthread_mutex_lock(&b->m);
-    struct entry *e=b->head;
-    while(e) {
-        if(e->h == h && strcmp(e->key, key) == 0) 
-            break; 
-        e = e->next; 
-    }
-
-    record_t *r = NULL;
-    if(!e) {
-        e = calloc(1,sizeof *e);
-        e->h = h; 
-        e->key = strdup_safe(key);
-        r = rec_create(key,h);
-        e->rec = r;
-        e->next = b->head;
-        b->head = e;
-        r->e = e;
+int cache_acquire(cache_t *c, const cache_key_t *key, cache_acquire_t *out) {
+    uint64_t h = key->h;
+    sketch_add(&c->sketch, h);
+    struct cache_shard *s=shard_of(c,h);
+    pthread_mutex_lock(&s->m);
+    record_t *r = htab_find(&s->t, h, key_eq, key);
+    if(!r) {
+        r = rec_create(c,key);
+        if(!r || htab_insert(&s->t, h, r)) {
+            pthread_mutex_unlock(&s->m);
+            rec_free(r);
+            out->rec = NULL;
+            return -1;
+        }
         __atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
         out->is_fetcher = 1;
     } else {
-        r = e->rec;
         __atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
         out->is_fetcher = 0;
     }
     atomic_fetch_add(&r->refcnt, 1);
-    pthread_mutex_unlock(&b->m);
 
-    pthread_mutex_lock(&r->m);
-    if(!r->completed && !r->canceled && !r->has_fetcher) {
+    out->rec = r;
+    if(rec_state(r) & RS_DONE) {
+        pthread_mutex_unlock(&s->m);
+        __atomic_add_fetch(&c->hit_bytes, rec_size(r), __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // joining under the shard lock keeps rec_pass from missing a joiner
+    rec_lock(r);
+    uint32_t st = atomic_load_explicit(&r->st, memory_order_relaxed);
+    if(st & RS_DONE) {
+        __atomic_add_fetch(&c->hit_bytes, rec_size(r), __ATOMIC_RELAXED);
+    } else if(!(st & RS_CANCELED) && !r->has_fetcher) {
         r->has_fetcher=1; 
         out->is_fetcher=1;
+    } else if(!(st & RS_CANCELED) && !out->is_fetcher) {
+        r->joiners++;
     }
-
-    out->rec = r;
-    pthread_mutex_unlock(&r->m);
+    rec_unlock(r);
+    pthread_mutex_unlock(&s->m);
 
     return 0;
 }
 
+void cache_retain(record_t *r) {
+    atomic_fetch_add(&r->refcnt, 1);
+}
+
 void cache_release(record_t *r) {
     if(!r) 
         return;
@@ -180,161 +380,696 @@ void cache_release(record_t *r) {
         rec_free(r);
 }
 
-static void lru_remove(cache_t *c, record_t *r) {
-    if(!r->in_lru) 
-        return;
-    if(r->prev) 
-        r->prev->next = r->next; 
-    else 
-        c->lru_head = r->next;
+static int heap_less(record_t *a, record_t *b) {
+    return a->pri < b->pri;
+}
+
+static void heap_set(cache_t *c, size_t i, record_t *r) {
+    c->heap[i] = r;
+    r->heap_idx = (uint32_t)i;
+}
+
+static void heap_up(cache_t *c, size_t i) {
+    record_t *r = c->heap[i];
+    while(i > 0) {
+        size_t up = (i - 1) / 2;
+        if(!heap_less(r, c->heap[up]))
+            break;
+        heap_set(c, i, c->heap[up]);
+        i = up;
+    }
+    heap_set(c, i, r);
+}
+
+static void heap_down(cache_t *c, size_t i) {
+    record_t *r = c->heap[i];
+    while(1) {
+        size_t k = 2 * i + 1;
+        if(k >= c->heap_len)
+            break;
+        if(k + 1 < c->heap_len && heap_less(c->heap[k + 1], c->heap[k]))
+            k++;
+        if(!heap_less(c->heap[k], r))
+            break;
+        heap_set(c, i, c->heap[k]);
+        i = k;
+    }
+    heap_set(c, i, r);
+}
+
+/* GDSF: H = L + freq * cost / size, where cost is how long the fetch took
+   and L is the priority of the last record evicted from main. */
+static double gdsf_priority(cache_t *c, record_t *r, unsigned freq) {
+    size_t size = r->charged;
+    return c->inflation + (double)(freq + 1) * (double)(r->cost_us ? r->cost_us : 1) /
+                          (double)(size ? size : 1);
+}
+
+static int main_insert(cache_t *c, record_t *r) {
+    if(c->heap_len == c->heap_cap) {
+        size_t nc = c->heap_cap ? c->heap_cap * 2 : 1024;
+        record_t **nh = realloc(c->heap, nc * sizeof *nh);
+        if(!nh)
+            return -1;
+        c->heap = nh;
+        c->heap_cap = nc;
+    }
+    r->pri_freq = atomic_load_explicit(&r->freq, memory_order_relaxed);
+    r->pri = gdsf_priority(c, r, r->pri_freq);
+    heap_set(c, c->heap_len++, r);
+    heap_up(c, r->heap_idx);
+    r->region = REG_MAIN;
+    return 0;
+}
+
+static void main_remove(cache_t *c, record_t *r) {
+    size_t i = r->heap_idx;
+    record_t *last = c->heap[--c->heap_len];
+    if(last != r) {
+        heap_set(c, i, last);
+        heap_down(c, i);
+        heap_up(c, last->heap_idx);
+    }
+    if(r->pri > c->inflation)
+        c->inflation = r->pri;
+    r->region = REG_NONE;
+}
+
+/* Hits only bump the record's counter; a priority is brought up to date
+   when its record reaches the top of the heap, so hits stay lock-free. */
+static record_t *main_victim(cache_t *c) {
+    while(c->heap_len) {
+        record_t *r = c->heap[0];
+        unsigned f = atomic_load_explicit(&r->freq, memory_order_relaxed);
+        if(f == r->pri_freq)
+            return r;
+        r->pri_freq = f;
+        r->pri = gdsf_priority(c, r, f);
+        heap_down(c, 0);
+    }
+    return NULL;
+}
+
+static void window_push(cache_t *c, record_t *r) {
+    r->prev = NULL;
+    r->next = c->win_head;
+    if(c->win_head)
+        c->win_head->prev = r;
+    else
+        c->win_tail = r;
+    c->win_head = r;
+    __atomic_add_fetch(&c->window_bytes, r->charged, __ATOMIC_RELAXED);
+    r->region = REG_WINDOW;
+}
+
+static void window_remove(cache_t *c, record_t *r) {
+    if(r->prev)
+        r->prev->next = r->next;
+    else
+        c->win_head = r->next;
     if(r->next)
-        r->next->prev = r->prev; 
+        r->next->prev = r->prev;
     else
-        c->lru_tail = r->prev;
-    r->prev = r->next = NULL; 
-    r->in_lru = 0;
+        c->win_tail = r->prev;
+    r->prev = r->next = NULL;
+    __atomic_sub_fetch(&c->window_bytes, r->charged, __ATOMIC_RELAXED);
+    r->region = REG_NONE;
 }
 
-static void lru_push_front(cache_t *c, record_t *r) {
-    r->prev = NULL; 
-    r->next = c->lru_head;
-    if(c->lru_head) 
-        c->lru_head->prev = r; 
-    else 
-        c->lru_tail = r;
-    c->lru_head = r;
-    r->in_lru = 1;
+/* The window is an LRU approximated with a referenced bit, so hits stay
+   lock-free: a hit record reaching the tail is moved back to the head
+   instead. */
+static record_t *window_oldest(cache_t *c) {
+    record_t *r;
+    while((r = c->win_tail) && atomic_load_explicit(&r->referenced, memory_order_relaxed)) {
+        atomic_store_explicit(&r->referenced, 0, memory_order_relaxed);
+        window_remove(c,r);
+        window_push(c,r);
+    }
+    return r;
 }
 
-void rec_touch_lru(cache_t *c, record_t *r) {
-    pthread_mutex_lock(&c->lru_m);
-    if(r->in_lru) {
-        lru_remove(c,r);
-        lru_push_front(c,r);
+/* W-TinyLFU: completed records land in a small window. Once the window is
+   over its share, its oldest record moves to main while main has room;
+   after that it has to beat main's victim in the frequency sketch, and
+   whichever loses is evicted. */
+static record_t *pick_victim(cache_t *c, size_t target) {
+    while(1) {
+        if(c->window_bytes <= c->window_limit || !c->win_tail)
+            return c->heap_len ? main_victim(c) : window_oldest(c);
+
+        record_t *cand = window_oldest(c);
+        size_t main_bytes = __atomic_load_n(&c->bytes_completed, __ATOMIC_RELAXED) - c->window_bytes;
+        if(!c->heap_len || main_bytes + cand->charged + c->window_limit <= target) {
+            window_remove(c,cand);
+            if(main_insert(c,cand))
+                return cand;
+            __atomic_add_fetch(&c->admits, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        record_t *v = main_victim(c);
+        if(sketch_freq(&c->sketch, cand->h) > sketch_freq(&c->sketch, v->h)) {
+            window_remove(c,cand);
+            if(main_insert(c,cand))
+                return cand;
+            __atomic_add_fetch(&c->admits, 1, __ATOMIC_RELAXED);
+            return v;
+        }
+        __atomic_add_fetch(&c->rejects, 1, __ATOMIC_RELAXED);
+        return cand;
     }
-    pthread_mutex_unlock(&c->lru_m);
 }
 
-static void try_evict_until_soft(cache_t *c) {
-    pthread_mutex_lock(&c->lru_m);
-    while(c->bytes_completed > c->soft_limit && c->lru_tail) {
-        record_t *r = c->lru_tail;
-        lru_remove(c,r);
-        c->bytes_completed -= r->total;
+void rec_touch(cache_t *c, record_t *r) {
+    (void)c;
+    if(!atomic_load_explicit(&r->referenced, memory_order_relaxed))
+        atomic_store_explicit(&r->referenced, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&r->freq, 1, memory_order_relaxed);
+}
+
+static size_t cache_used(cache_t *c) {
+    return __atomic_load_n(&c->bytes_completed, __ATOMIC_RELAXED) +
+           __atomic_load_n(&c->bytes_inflight, __ATOMIC_RELAXED);
+}
+
+static size_t cache_completed(cache_t *c) {
+    return __atomic_load_n(&c->bytes_completed, __ATOMIC_RELAXED);
+}
+
+// only completed records can go, so in-flight bytes do not count toward target
+static void evict_down_to(cache_t *c, size_t target) {
+    pthread_mutex_lock(&c->policy_m);
+    while(cache_completed(c) > target) {
+        record_t *r = pick_victim(c, target);
+        if(!r)
+            break;
+        if(r->region == REG_WINDOW)
+            window_remove(c,r);
+        else if(r->region == REG_MAIN)
+            main_remove(c,r);
+        __atomic_sub_fetch(&c->bytes_completed, r->charged, __ATOMIC_RELAXED);
         __atomic_add_fetch(&c->evicts, 1, __ATOMIC_RELAXED);
 
-        struct bucket *b=bucket_of(c, r->h);
-        pthread_mutex_lock(&b->m);
-        struct entry **pp=&b->head;
-        while(*pp){
-            if((*pp)->rec == r){ 
-                struct entry *dead=*pp; *pp=dead->next;
-                if(atomic_fetch_sub(&r->refcnt,1) == 1) {
-                    pthread_mutex_unlock(&b->m); 
-                    pthread_mutex_unlock(&c->lru_m); 
-                    rec_free(r); 
-
-                    return; 
-                }
-                free(dead->key); 
-                free(dead); 
+        struct cache_shard *s=shard_of(c, r->h);
+        pthread_mutex_lock(&s->m);
+        int found = htab_remove(&s->t, r->h, r) == 0;
+        pthread_mutex_unlock(&s->m);
 
-                break;
-            }
-            pp=&(*pp)->next;
-        }
-        pthread_mutex_unlock(&b->m);
+        if(found)
+            cache_release(r);
+    }
+
+    pthread_mutex_unlock(&c->policy_m);
+}
+
+static void deadline_after(struct timespec *ts, long ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += ms * 1000000L;
+    ts->tv_sec += ts->tv_nsec / 1000000000L;
+    ts->tv_nsec %= 1000000000L;
+}
 
-        if(atomic_load(&r->refcnt) == 0) {
-            pthread_mutex_unlock(&c->lru_m); 
-            rec_free(r); 
-            return;
+static size_t chunk_at(record_t *r, size_t *off, const void **ptr, size_t *len);
+
+/* Large bodies go to a memfd, mapped so readers see it like any flat
+   buffer, which lets hits hand the file to the kernel instead. */
+static char *flat_alloc(size_t total, int *fd) {
+    *fd = -1;
+    if(REC_MEMFD && total >= MEMFD_MIN) {
+        int f = memfd_create("rec", MFD_CLOEXEC);
+        if(f < 0)
+            return NULL;
+        char *p = MAP_FAILED;
+        if(ftruncate(f, (off_t)total) == 0)
+            p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+        if(p == MAP_FAILED) {
+            close(f);
+            return NULL;
         }
+        *fd = f;
+        return p;
     }
+    return malloc(total);
+}
 
-    pthread_mutex_unlock(&c->lru_m);
+static int same_rec(const void *val, const void *key) {
+    return val == key;
 }
 
-int rec_append(cache_t *c, record_t *r, const void *buf, size_t n) {
-    if(n==0) 
+/* Copies a finished record into one exact-size buffer. The queue's
+   reference keeps the segments alive, so the copy runs with no lock held
+   and is charged as in flight meanwhile. Readers hold a reference for as
+   long as they use segment pointers and new ones come in through the
+   shard lock, so if under that lock the record is still indexed and only
+   the index's and the queue's references are left, the segments are
+   swapped for the copy. Returns 0 if the record is still being read. */
+static int compact_one(cache_t *c, record_t *r) {
+    int refs = atomic_load(&r->refcnt);
+    if(refs == 1)
+        return 1; // evicted
+    if(refs != 2)
         return 0;
-    try_evict_until_soft(c);
 
-    pthread_mutex_lock(&r->m);
-    if(r->canceled || r->completed) {
-        pthread_mutex_unlock(&r->m);
-        return -1;
+    size_t total = rec_size(r);
+    __atomic_add_fetch(&c->bytes_inflight, total, __ATOMIC_RELAXED);
+    int fd;
+    char *flat = flat_alloc(total, &fd);
+    size_t off = 0;
+    while(flat && off < total) {
+        const void *p;
+        size_t len = 0;
+        chunk_at(r, &off, &p, &len);
+        memcpy(flat + off, p, len);
+        off += len;
     }
 
-    size_t need = r->total + n;
-    while(need > r->nblocks*BLOCK_SZ) {
-        if(r->nblocks == r->capblocks) {
-            size_t nc = r->capblocks? r->capblocks*2 : 4;
-            block_t **nb = realloc(r->blocks, nc*sizeof(*nb));
-            if(!nb) {
-                pthread_mutex_unlock(&r->m);
-                return -1;
-            }
+    int swapped = 0;
+    if(flat) {
+        struct cache_shard *s = shard_of(c, r->h);
+        pthread_mutex_lock(&s->m);
+        if(atomic_load(&r->refcnt) == 2 && htab_find(&s->t, r->h, same_rec, r) == r) {
+            r->fd = fd;
+            atomic_store_explicit(&r->flat, flat, memory_order_release);
+            rec_free_segs(r);
+            swapped = 1;
+        }
+        pthread_mutex_unlock(&s->m);
+    }
+    __atomic_sub_fetch(&c->bytes_inflight, total, __ATOMIC_RELAXED);
+    if(!flat)
+        return 1;
+    if(!swapped) {
+        flat_free(flat, total, fd);
+        return 0;
+    }
+
+    // a body that had no slack costs the now unused inline area instead
+    pthread_mutex_lock(&c->policy_m);
+    if(r->region != REG_NONE) {
+        size_t was = r->charged;
+        r->charged = sizeof *r + r->klen + 1 + total;
+        size_t saved = was > r->charged ? was - r->charged : 0;
+        size_t grew = r->charged > was ? r->charged - was : 0;
+        __atomic_sub_fetch(&c->bytes_completed, saved, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&c->bytes_completed, grew, __ATOMIC_RELAXED);
+        if(r->region == REG_WINDOW) {
+            __atomic_sub_fetch(&c->window_bytes, saved, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&c->window_bytes, grew, __ATOMIC_RELAXED);
+        } else {
+            r->pri = gdsf_priority(c, r, r->pri_freq);
+            heap_down(c, r->heap_idx);
+            heap_up(c, r->heap_idx);
+        }
+        __atomic_add_fetch(&c->compact_saved, saved - grew, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&c->policy_m);
+    __atomic_add_fetch(&c->compacted, 1, __ATOMIC_RELAXED);
+    if(fd >= 0)
+        __atomic_add_fetch(&c->compact_files, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/* Takes the queue so finishes and evictions are not held up by copies;
+   records still being read go back on it. */
+static void compact_pass(cache_t *c) {
+    pthread_mutex_lock(&c->policy_m);
+    record_t *list = c->compact_head;
+    c->compact_head = NULL;
+    pthread_mutex_unlock(&c->policy_m);
+
+    record_t *keep = NULL, **tail = &keep;
+    while(list) {
+        record_t *r = list;
+        list = r->cnext;
+        r->cnext = NULL;
+        if(compact_one(c, r)) {
+            cache_release(r);
+        } else {
+            *tail = r;
+            tail = &r->cnext;
+        }
+    }
+    if(keep) {
+        pthread_mutex_lock(&c->policy_m);
+        *tail = c->compact_head;
+        c->compact_head = keep;
+        pthread_mutex_unlock(&c->policy_m);
+    }
+}
 
-            r->blocks = nb;
-            r->capblocks = nc;
+static void *evictor_main(void *arg) {
+    cache_t *c = (cache_t *)arg;
+    pthread_mutex_lock(&c->ev_m);
+    while(!c->ev_stop) {
+        if(!c->ev_kicked) {
+            struct timespec ts;
+            deadline_after(&ts, SWEEP_INTERVAL_MS);
+            if(pthread_cond_timedwait(&c->ev_wake, &c->ev_m, &ts) == ETIMEDOUT) {
+                // idle tick: hand pages of surplus free blocks back to the OS
+                pthread_mutex_unlock(&c->ev_m);
+                compact_pass(c);
+                blkpool_trim(&c->pool, BLKPOOL_KEEP_BYTES);
+                pthread_mutex_lock(&c->ev_m);
+            }
+            continue;
         }
-        r->blocks[r->nblocks] = calloc(1,sizeof(block_t));
-        if(!r->blocks[r->nblocks]) {
-            pthread_mutex_unlock(&r->m);
+        pthread_mutex_unlock(&c->ev_m);
+        compact_pass(c);
+        evict_down_to(c, c->low_mark);
+        pthread_mutex_lock(&c->ev_m);
+        c->ev_kicked = 0;
+        pthread_cond_broadcast(&c->ev_done);
+    }
+    pthread_mutex_unlock(&c->ev_m);
+    return NULL;
+}
+
+/* Past the high watermark, in-flight bytes included, the evictor is kicked
+   if completed records are above the low one; past the hard ceiling it is
+   kicked regardless and the fetcher waits (bounded) for it, which is the
+   only place appends can block on memory. */
+static void cache_pressure(cache_t *c) {
+    size_t used = cache_used(c);
+    if(used <= c->soft_limit)
+        return;
+    int evictable = cache_completed(c) > c->low_mark;
+    if(!c->has_evictor) {
+        if(evictable)
+            evict_down_to(c, c->low_mark);
+        return;
+    }
+    if(!evictable && used <= c->hard_limit)
+        return;
+
+    pthread_mutex_lock(&c->ev_m);
+    if(!c->ev_kicked) {
+        c->ev_kicked = 1;
+        pthread_cond_signal(&c->ev_wake);
+    }
+    if(used > c->hard_limit) {
+        __atomic_add_fetch(&c->stalls, 1, __ATOMIC_RELAXED);
+        struct timespec ts;
+        deadline_after(&ts, EVICT_STALL_MS);
+        while(c->ev_kicked && !c->ev_stop && cache_used(c) > c->hard_limit)
+            if(pthread_cond_timedwait(&c->ev_done, &c->ev_m, &ts) == ETIMEDOUT)
+                break;
+    }
+    pthread_mutex_unlock(&c->ev_m);
+}
+
+/* Bytes below REC_INLINE live in the record itself. Past that, heap
+   segments double from `first` up to BLOCK_SZ and then stay at BLOCK_SZ,
+   so an offset maps to its segment arithmetically. */
+static void seg_layout(record_t *r, size_t first) {
+    r->first = first;
+    r->grow_n = 0;
+    for(size_t s = first; s < BLOCK_SZ; s <<= 1)
+        r->grow_n++;
+    r->grow_end = first * (((size_t)1 << r->grow_n) - 1);
+}
+
+static size_t seg_index(const record_t *r, size_t off, size_t *start) {
+    if(off < r->grow_end) {
+        size_t k = 63 - (size_t)__builtin_clzll(off / r->first + 1);
+        *start = r->first * (((size_t)1 << k) - 1);
+        return k;
+    }
+    size_t k = (off - r->grow_end) / BLOCK_SZ;
+    *start = r->grow_end + k * BLOCK_SZ;
+    return r->grow_n + k;
+}
+
+static size_t seg_span(const record_t *r, size_t k) {
+    return k < r->grow_n ? r->first << k : BLOCK_SZ;
+}
+
+static size_t seg_start(const record_t *r, size_t k) {
+    if(k < r->grow_n)
+        return r->first * (((size_t)1 << k) - 1);
+    return r->grow_end + (k - r->grow_n) * BLOCK_SZ;
+}
+
+/* Appends one segment. With a declared length the first segment is sized
+   to the rest of the body and the one holding its end is cut to fit. */
+static int seg_grow(cache_t *c, record_t *r, blkvec_t **vp) {
+    blkvec_t *v = *vp;
+    if(!r->nsegs) {
+        size_t first = SEG_MIN;
+        if(r->declared_length > REC_INLINE)
+            first = (r->declared_length - REC_INLINE + 63) & ~(size_t)63;
+        seg_layout(r, first < BLOCK_SZ ? first : BLOCK_SZ);
+    } else if(v->s[r->nsegs-1].sz < seg_span(r, r->nsegs-1)) {
+        return -1; // more data than was declared
+    }
+
+    if(!v || r->nsegs == v->cap) {
+        // readers may still hold the old vector, so it is retired, not freed
+        size_t nc = v ? v->cap*2 : 4;
+        blkvec_t *nv = malloc(sizeof *nv + nc*sizeof(seg_t));
+        if(!nv)
             return -1;
+        nv->cap = nc;
+        nv->prev = v;
+        if(v)
+            memcpy(nv->s, v->s, r->nsegs*sizeof(seg_t));
+        v = *vp = nv;
+        atomic_store_explicit(&r->blocks, v, memory_order_release);
+    }
+
+    size_t sz = seg_span(r, r->nsegs);
+    size_t body = r->declared_length > REC_INLINE ? r->declared_length - REC_INLINE : 0;
+    if(body > r->covered && body - r->covered < sz)
+        sz = body - r->covered;
+    char *p = sz == BLOCK_SZ ? blkpool_alloc(&c->pool) : malloc(sz);
+    if(!p)
+        return -1;
+    v->s[r->nsegs].p = p;
+    v->s[r->nsegs].sz = sz;
+    r->nsegs++;
+    r->covered += sz;
+    return 0;
+}
+
+/* Grows the segments to hold need bytes; the header is charged with the
+   first bytes. */
+static int rec_cover(cache_t *c, record_t *r, size_t need) {
+    size_t charged = r->charged;
+    if(!r->charged)
+        r->charged = sizeof *r + r->klen + 1;
+    blkvec_t *v = atomic_load_explicit(&r->blocks, memory_order_relaxed);
+    int rc = 0;
+    while(need > REC_INLINE + r->covered) {
+        size_t had = r->covered;
+        if(seg_grow(c, r, &v)) {
+            rc = -1;
+            break;
         }
+        r->charged += r->covered - had;
+    }
+    __atomic_add_fetch(&c->bytes_inflight, r->charged - charged, __ATOMIC_RELAXED);
+    return rc;
+}
 
-        r->nblocks++;
+/* Writable bytes at off, which must be covered, and how many follow it
+   contiguously. Fetcher side only. */
+static char *body_at(record_t *r, size_t off, size_t *can) {
+    if(off < REC_INLINE) {
+        *can = REC_INLINE - off;
+        return r->inl + off;
     }
-    size_t off = r->total;
+    blkvec_t *v = atomic_load_explicit(&r->blocks, memory_order_relaxed);
+    size_t start;
+    size_t k = seg_index(r, off - REC_INLINE, &start);
+    size_t so = off - REC_INLINE - start;
+    *can = v->s[k].sz - so;
+    return v->s[k].p + so;
+}
+
+static void rec_publish(record_t *r, size_t total) {
+    atomic_store_explicit(&r->total, total, memory_order_release);
+    if(total >= REC_WAKE_BYTES)
+        rec_wake(r, total - REC_WAKE_BYTES + 1);
+}
+
+static int rec_settled(record_t *r) {
+    return (atomic_load_explicit(&r->st, memory_order_relaxed) & (RS_DONE | RS_CANCELED)) != 0;
+}
+
+int rec_append(cache_t *c, record_t *r, const void *buf, size_t n) {
+    if(n==0) 
+        return 0;
+    cache_pressure(c);
+
+    rec_lock(r);
+    size_t total = atomic_load_explicit(&r->total, memory_order_relaxed);
+    size_t need = total + n;
+    if(rec_settled(r) || rec_cover(c, r, need)) {
+        rec_unlock(r);
+        return -1;
+    }
+    size_t off = total;
     const unsigned char *p = (const unsigned char*)buf;
     size_t left = n;
     while(left){
-        size_t bi = off / BLOCK_SZ;
-        size_t bo = off % BLOCK_SZ;
-        size_t can = BLOCK_SZ - bo;
+        size_t can;
+        char *dst = body_at(r, off, &can);
         size_t take = left<can?left:can;
-        memcpy(r->blocks[bi]->data + bo, p, take);
-        size_t u = bo + take;
-        
-        if(u > r->blocks[bi]->used) 
-            r->blocks[bi]->used = u;
+        memcpy(dst, p, take);
 
         off += take;
         p += take;
         left -= take;
     }
-    r->total += n;
-    pthread_cond_broadcast(&r->updated);
-    pthread_mutex_unlock(&r->m);
+    rec_publish(r, need);
+    rec_unlock(r);
+    return 0;
+}
+
+/* Space past the published end for the fetcher to receive into. Readers
+   never look beyond total, so filling it needs no lock; rec_commit then
+   publishes what was written. *len is trimmed to the contiguous room. */
+void *rec_reserve(cache_t *c, record_t *r, size_t *len) {
+    cache_pressure(c);
+
+    rec_lock(r);
+    size_t total = atomic_load_explicit(&r->total, memory_order_relaxed);
+    if(rec_settled(r) || rec_cover(c, r, total + 1)) {
+        rec_unlock(r);
+        return NULL;
+    }
+    size_t can;
+    char *p = body_at(r, total, &can);
+    if(*len > can)
+        *len = can;
+    rec_unlock(r);
+    return p;
+}
+
+int rec_commit(record_t *r, size_t n) {
+    rec_lock(r);
+    if(rec_settled(r)) {
+        rec_unlock(r);
+        return -1;
+    }
+    rec_publish(r, atomic_load_explicit(&r->total, memory_order_relaxed) + n);
+    rec_unlock(r);
     return 0;
 }
 
+/* Worth it when the body is split or the segments carry more slack than
+   the inline area that compaction leaves unused, and always for a body
+   big enough for a memfd. */
+static int compactable(cache_t *c, record_t *r) {
+    size_t total = rec_size(r);
+    if(!c->has_evictor || !r->nsegs)
+        return 0;
+    if(REC_MEMFD && total >= MEMFD_MIN)
+        return 1;
+    if(total > COMPACT_MAX)
+        return 0;
+    size_t slack = REC_INLINE + r->covered - total;
+    return r->nsegs > 1 || slack >= REC_INLINE;
+}
+
 void rec_finish(cache_t *c, record_t *r) {
-    pthread_mutex_lock(&r->m);
-    r->completed=1; 
+    rec_lock(r);
+    if(rec_settled(r)) {
+        rec_unlock(r);
+        return;
+    }
+    __atomic_sub_fetch(&c->bytes_inflight, r->charged, __ATOMIC_RELAXED);
     r->has_fetcher=0;
-    pthread_cond_broadcast(&r->updated);
-    pthread_mutex_unlock(&r->m);
+    size_t joiners = r->joiners;
+    rec_settle(r, RS_DONE);
+    rec_unlock(r);
 
-    pthread_mutex_lock(&c->lru_m);
+    // readers that joined the fetch were served without going upstream
+    __atomic_add_fetch(&c->fetch_bytes, rec_size(r), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->hit_bytes, joiners * rec_size(r), __ATOMIC_RELAXED);
     if(r->keep_on_complete) {
-        c->bytes_completed += r->total;
-        lru_push_front(c,r);
+        r->cost_us = (uint32_t)now_us() - r->born_us;
+        pthread_mutex_lock(&c->policy_m);
+        __atomic_add_fetch(&c->bytes_completed, r->charged, __ATOMIC_RELAXED);
+        window_push(c,r);
+        if(compactable(c, r)) {
+            cache_retain(r);
+            r->cnext = c->compact_head;
+            c->compact_head = r;
+        }
+        pthread_mutex_unlock(&c->policy_m);
         __atomic_add_fetch(&c->stores,1,__ATOMIC_RELAXED);
     }
-
-    pthread_mutex_unlock(&c->lru_m);
 }
 
 void rec_cancel(cache_t *c, record_t *r) {
-    (void)c;
-    pthread_mutex_lock(&r->m);
-    r->canceled=1; 
+    rec_lock(r);
+    if(rec_settled(r)) {
+        rec_unlock(r);
+        return;
+    }
+    __atomic_sub_fetch(&c->bytes_inflight, r->charged, __ATOMIC_RELAXED);
     r->has_fetcher=0;
-    pthread_cond_broadcast(&r->updated);
-    pthread_mutex_unlock(&r->m);
+    rec_settle(r, RS_CANCELED);
+    rec_unlock(r);
+}
+
+/* Bytes below total are immutable and their blocks are reachable from the
+   vector published before total, so an acquire load of total is all a
+   reader needs. */
+static size_t chunk_at(record_t *r, size_t *off, const void **ptr, size_t *len) {
+    size_t total = atomic_load_explicit(&r->total, memory_order_acquire);
+    if(*off < total) {
+        size_t avail;
+        char *flat = atomic_load_explicit(&r->flat, memory_order_acquire);
+        if(flat) {
+            *ptr = flat + *off;
+            avail = total - *off;
+        } else if(*off < REC_INLINE) {
+            *ptr = r->inl + *off;
+            avail = REC_INLINE - *off;
+        } else {
+            blkvec_t *v = atomic_load_explicit(&r->blocks, memory_order_acquire);
+            size_t start;
+            size_t k = seg_index(r, *off - REC_INLINE, &start);
+            size_t so = *off - REC_INLINE - start;
+            *ptr = v->s[k].p + so;
+            avail = v->s[k].sz - so;
+        }
+        if(avail > total - *off)
+            avail = total - *off;
+        *len = avail;
+    }
+    return *len;
+}
+
+static int chunk_or_end(record_t *r, size_t *off, const void **ptr, size_t *len, int *done, int *canceled) {
+    if(chunk_at(r, off, ptr, len))
+        return 1;
+    uint32_t st = rec_state(r);
+    if(st & RS_CANCELED) {
+        *canceled = 1;
+        return 1;
+    }
+    if(st & RS_DONE) {
+        if(!chunk_at(r, off, ptr, len))
+            *done = 1;
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct {
+    rec_waiter_t w;
+    _Atomic uint32_t fired;
+} rec_sleeper_t;
+
+/* The sleeper's frame may be gone once fired is set; a stray wake of
+   whatever reuses the address is harmless since every futex wait loops. */
+static void sleeper_wake(rec_waiter_t *w) {
+    rec_sleeper_t *s = (rec_sleeper_t *)w;
+    atomic_store_explicit(&s->fired, 1, memory_order_release);
+    futex_wake(&s->fired, 1);
 }
 
 size_t rec_wait_chunk(record_t *r, size_t *off, const void **ptr, size_t *len, int *done, int *canceled){
@@ -342,40 +1077,320 @@ size_t rec_wait_chunk(record_t *r, size_t *off, const void **ptr, size_t *len, i
     *canceled=0; 
     *ptr=NULL; 
     *len=0;
-    pthread_mutex_lock(&r->m);
-    while(1) {
-        if(*off < r->total) {
-            size_t bi = *off / BLOCK_SZ;
-            size_t bo = *off % BLOCK_SZ;
-            size_t avail = r->blocks[bi]->used - bo;
-            if(avail == 0){ 
-                if(bi+1 < r->nblocks){
-                    bi++;
-                    bo = 0;
-                    avail = r->blocks[bi]->used;
-                    *off = bi*BLOCK_SZ;
-                }
-            }
-            if(avail > 0){
-                *ptr = r->blocks[bi]->data + bo;
-                *len = avail;
-                break;
-            }
-        }
-        if(r->canceled) {
-            *canceled = 1;
+    rec_sleeper_t s = { .w.wake = sleeper_wake };
+    while(!chunk_or_end(r, off, ptr, len, done, canceled)) {
+        rec_lock(r);
+        if(chunk_or_end(r, off, ptr, len, done, canceled)) {
+            rec_unlock(r);
             break;
         }
-        if(r->completed){
-            *done = 1;
+        atomic_store_explicit(&s.fired, 0, memory_order_relaxed);
+        rec_arm(r, &s.w, *off);
+        rec_unlock(r);
+        while(!atomic_load_explicit(&s.fired, memory_order_acquire))
+            futex_wait(&s.fired, 0);
+    }
+    return *len;
+}
+
+size_t rec_poll_chunk(record_t *r, size_t *off, const void **ptr, size_t *len, int *done, int *canceled, rec_waiter_t *w){
+    *done=0; 
+    *canceled=0; 
+    *ptr=NULL; 
+    *len=0;
+    if(chunk_or_end(r, off, ptr, len, done, canceled) || !w)
+        return *len;
+
+    rec_lock(r);
+    if(!chunk_or_end(r, off, ptr, len, done, canceled) && !w->armed)
+        rec_arm(r, w, *off);
+    rec_unlock(r);
+    return *len;
+}
+
+/* The fetcher calls this when it is about to wait on upstream, so readers
+   below their threshold still get what has arrived. */
+void rec_flush(record_t *r) {
+    rec_lock(r);
+    rec_wake(r, atomic_load_explicit(&r->total, memory_order_relaxed));
+    rec_unlock(r);
+}
+
+/* Readers of a finished record never hold anything back, so only those
+   that come in while it is being fetched take a cursor. */
+void rec_cursor_attach(record_t *r, rec_cursor_t *cur) {
+    atomic_store_explicit(&cur->at, 0, memory_order_relaxed);
+    atomic_store_explicit(&cur->can_take, 0, memory_order_relaxed);
+    cur->linked = 0;
+    if(rec_state(r) & RS_DONE)
+        return;
+    rec_lock(r);
+    if(!rec_settled(r)) {
+        cur->next = r->cursors;
+        r->cursors = cur;
+        cur->linked = 1;
+        r->nseen++;
+    }
+    rec_unlock(r);
+}
+
+// called with lk held
+static void rec_window_wake(record_t *r) {
+    rec_waiter_t *w = atomic_exchange_explicit(&r->win_waiter, NULL, memory_order_relaxed);
+    if(w) {
+        w->armed = 0;
+        w->wake(w);
+    }
+}
+
+/* The reader is done with everything below at. Pairs with rec_window:
+   either the fetcher sees the new position or the reader sees it wait. */
+void rec_cursor_move(record_t *r, rec_cursor_t *cur, size_t at) {
+    if(!cur->linked)
+        return;
+    atomic_store_explicit(&cur->at, at, memory_order_seq_cst);
+    if(!atomic_load_explicit(&r->win_waiter, memory_order_seq_cst))
+        return;
+    rec_lock(r);
+    rec_window_wake(r);
+    rec_unlock(r);
+}
+
+void rec_cursor_detach(record_t *r, rec_cursor_t *cur) {
+    if(!cur->linked)
+        return;
+    rec_lock(r);
+    rec_cursor_t **pp = &r->cursors;
+    while(*pp != cur)
+        pp = &(*pp)->next;
+    *pp = cur->next;
+    cur->linked = 0;
+    rec_window_wake(r);
+    rec_unlock(r);
+}
+
+void rec_cursor_can_take(rec_cursor_t *cur, int yes) {
+    atomic_store_explicit(&cur->can_take, yes ? 1 : -1, memory_order_release);
+}
+
+/* Frees the segments that end at or below low. Called with lk held. */
+static void rec_drop(cache_t *c, record_t *r, size_t low) {
+    if(low <= REC_INLINE)
+        return;
+    blkvec_t *v = atomic_load_explicit(&r->blocks, memory_order_relaxed);
+    size_t freed = 0;
+    while(r->dropped < r->nsegs) {
+        seg_t *s = &v->s[r->dropped];
+        if(REC_INLINE + seg_start(r, r->dropped) + s->sz > low)
             break;
+        if(s->sz == BLOCK_SZ)
+            blkpool_free(r->pool, s->p);
+        else
+            free(s->p);
+        s->p = NULL;
+        freed += s->sz;
+        r->dropped++;
+    }
+    r->charged -= freed;
+    __atomic_sub_fetch(&c->bytes_inflight, freed, __ATOMIC_RELAXED);
+}
+
+/* The fetcher of a record that is not kept calls this before it takes
+   more from upstream. What every reader is past is freed; with more than
+   REC_WINDOW bytes ahead of the slowest reader it returns 1, with w (if
+   any) armed to be woken when a reader moves on, and -1 once all readers
+   are gone. Until every reader that joined has a cursor the window stays
+   open and nothing is freed. */
+int rec_window(cache_t *c, record_t *r, rec_waiter_t *w) {
+    if(r->keep_on_complete)
+        return 0;
+    rec_lock(r);
+    if(w) {
+        w->armed = 1;
+        atomic_store_explicit(&r->win_waiter, w, memory_order_seq_cst);
+    }
+    size_t total = atomic_load_explicit(&r->total, memory_order_relaxed);
+    size_t low = total;
+    int rc = 0;
+    if(r->nseen >= 1 + r->joiners) {
+        for(rec_cursor_t *cur = r->cursors; cur; cur = cur->next) {
+            size_t at = atomic_load_explicit(&cur->at, memory_order_seq_cst);
+            if(at < low)
+                low = at;
         }
-        pthread_cond_wait(&r->updated, &r->m);
+        rec_drop(c, r, low);
+        if(!r->cursors)
+            rc = -1;
+        else if(total - low >= REC_WINDOW)
+            rc = 1;
     }
-    pthread_mutex_unlock(&r->m);
-    return *len;
+    if(rc == 1) {
+        rec_wake(r, total);
+    } else if(w) {
+        atomic_store_explicit(&r->win_waiter, NULL, memory_order_relaxed);
+        w->armed = 0;
+    }
+    rec_unlock(r);
+    return rc;
+}
+
+/* rec_window for a fetcher that may block: returns 0 once there is room. */
+int rec_window_wait(cache_t *c, record_t *r) {
+    rec_sleeper_t s = { .w.wake = sleeper_wake };
+    int rc;
+    while(1) {
+        atomic_store_explicit(&s.fired, 0, memory_order_relaxed);
+        rc = rec_window(c, r, &s.w);
+        if(rc != 1)
+            return rc;
+        while(!atomic_load_explicit(&s.fired, memory_order_acquire))
+            futex_wait(&s.fired, 0);
+    }
+}
+
+/* Takes an in-flight record out of the index so it is never kept; whoever
+   reads it now still gets all of it. With pass_fd set, it also hands the
+   rest of the body to the one reader, which requires that nobody joined
+   and that the reader said it can take it; 1 means it has not said yet. */
+static int rec_unlink(cache_t *c, record_t *r, int pass_fd, size_t left, int reuse) {
+    struct cache_shard *s = shard_of(c, r->h);
+    pthread_mutex_lock(&s->m);
+    rec_lock(r);
+    int ok = !rec_settled(r);
+    if(ok && pass_fd >= 0) {
+        rec_cursor_t *cur = r->cursors;
+        int take = cur && !cur->next && !r->joiners ? atomic_load_explicit(&cur->can_take, memory_order_acquire) : -1;
+        if(take <= 0) {
+            rec_unlock(r);
+            pthread_mutex_unlock(&s->m);
+            return take ? -1 : 1;
+        }
+    }
+    if(ok) {
+        r->keep_on_complete = 0;
+        if(pass_fd >= 0) {
+            r->pass_fd = pass_fd;
+            r->pass_left = left;
+            r->pass_reuse = reuse;
+            atomic_fetch_or_explicit(&r->st, RS_PASS, memory_order_release);
+        }
+    }
+    rec_unlock(r);
+    int found = ok && htab_remove(&s->t, r->h, r) == 0;
+    pthread_mutex_unlock(&s->m);
+    if(found)
+        cache_release(r);
+    return ok ? 0 : -1;
+}
+
+void rec_forget(cache_t *c, record_t *r) {
+    (void) rec_unlink(c, r, -1, 0, 0);
+}
+
+int rec_pass(cache_t *c, record_t *r, int fd, size_t left, int reuse) {
+    return rec_unlink(c, r, fd, left, reuse);
+}
+
+int rec_passing(record_t *r) {
+    return (rec_state(r) & RS_PASS) != 0;
+}
+
+/* The reader's side of rec_pass: the upstream socket, once. */
+int rec_take_pass(record_t *r, size_t *left, int *reuse) {
+    rec_lock(r);
+    int fd = r->pass_fd;
+    r->pass_fd = -1;
+    *left = r->pass_left;
+    *reuse = r->pass_reuse;
+    rec_unlock(r);
+    return fd;
+}
+
+/* The fetcher opens a record to taps once it knows the rest of the body
+   arrives as is; from then on every byte it publishes is teed first. */
+void rec_tee_open(record_t *r) {
+    atomic_fetch_or_explicit(&r->st, RS_TEE, memory_order_release);
+}
+
+int rec_teeing(record_t *r) {
+    return rec_state(r) == RS_TEE;
+}
+
+/* Whether any reader sits at the live end; the fetcher only tees then. */
+int rec_tapped(record_t *r) {
+    if(r->tapped)
+        return 1;
+    rec_lock(r);
+    int any = r->taps != NULL;
+    rec_unlock(r);
+    return any;
+}
+
+int rec_tap_attach(record_t *r, rec_tap_t *t) {
+    rec_lock(r);
+    int ok = rec_state(r) == RS_TEE && t->at == atomic_load_explicit(&r->total, memory_order_relaxed);
+    if(ok) {
+        atomic_store_explicit(&t->fired, 0, memory_order_relaxed);
+        t->sent = t->queued = 0;
+        t->next = r->taps;
+        r->taps = t;
+    }
+    rec_unlock(r);
+    return ok ? 0 : -1;
+}
+
+void rec_tap_wait(rec_tap_t *t) {
+    while(!atomic_load_explicit(&t->fired, memory_order_acquire))
+        futex_wait(&t->fired, 0);
+}
+
+/* Called by the fetcher with new bytes in hand but not yet published:
+   taps that attached at the current end join the live list, any others
+   missed bytes already and go back to the cache. The list is the
+   fetcher's to unlink from. */
+rec_tap_t **rec_taps(record_t *r) {
+    rec_lock(r);
+    size_t total = atomic_load_explicit(&r->total, memory_order_relaxed);
+    rec_tap_t *t = r->taps;
+    r->taps = NULL;
+    rec_unlock(r);
+    while(t) {
+        rec_tap_t *n = t->next;
+        if(t->at == total) {
+            t->next = r->tapped;
+            r->tapped = t;
+        } else {
+            tap_fire(t);
+        }
+        t = n;
+    }
+    return &r->tapped;
+}
+
+void rec_tap_release(rec_tap_t *t) {
+    tap_fire(t);
+}
+
+void rec_waiter_cancel(record_t *r, rec_waiter_t *w) {
+    rec_lock(r);
+    if(w->armed) {
+        rec_waiter_t **pp = &r->waiters;
+        while(*pp && *pp != w)
+            pp = &(*pp)->next;
+        if(*pp)
+            *pp = w->next;
+        w->next = NULL;
+        w->armed = 0;
+    }
+    rec_unlock(r);
 }
 
 const char* rec_key(record_t *r){ return r->key; }
-size_t rec_size(record_t *r){ return r->total; }
-int rec_is_completed(record_t *r){ return r->completed!=0; }
+void rec_declare_length(record_t *r, size_t n) {
+    if(!r->declared_length && !atomic_load_explicit(&r->total, memory_order_relaxed))
+        r->declared_length = n;
+}
+size_t rec_size(record_t *r){ return atomic_load_explicit(&r->total, memory_order_acquire); }
+/* fd is set before flat is published and never changes after. */
+int rec_file(record_t *r){ return atomic_load_explicit(&r->flat, memory_order_acquire) ? r->fd : -1; }
+int rec_is_completed(record_t *r){ return (rec_state(r) & RS_DONE) != 0; }
@@ -3,24 +3,74 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "blkpool.h"
+#include "htab.h"
+#include "sketch.h"
+
 typedef struct record record_t;
 
+/* An armed waiter waits for bytes at `at`. Appends wake it once
+   REC_WAKE_BYTES are there, rec_flush once any are, finish and cancel
+   always. */
+typedef struct rec_waiter {
+    void (*wake)(struct rec_waiter *w);
+    struct rec_waiter *next;
+    size_t at;
+    int armed;
+} rec_waiter_t;
+
+/* A reader parked at the live end of a body, to which the fetcher tees
+   upstream bytes through pipe and on into fd; sent is how many reached
+   fd before the tap was released, queued how many wait in the pipe. */
+typedef struct rec_tap {
+    struct rec_tap *next;
+    int fd;
+    int pipe[2];
+    size_t at, sent, queued;
+    _Atomic uint32_t fired;
+} rec_tap_t;
+
+/* A reader's place in a record: bytes below `at` are behind it. Once a
+   record is not kept, segments behind every reader are freed. */
+typedef struct rec_cursor {
+    struct rec_cursor *next;
+    _Atomic size_t at;
+    int linked;
+    _Atomic int can_take; // 0 until known, then 1 or -1: whether rec_take_pass is an option
+} rec_cursor_t;
+
 typedef struct cache {
-    struct bucket {
+    struct cache_shard {
         pthread_mutex_t m;
-        struct entry *head;
-    } *b;
-    size_t nbuckets;
+        htab_t t;
+    } *shards;
+    size_t nshards;
 
-    pthread_mutex_t lru_m;
-    record_t *lru_head, *lru_tail;
+    pthread_mutex_t policy_m;
+    record_t **heap;
+    size_t heap_len, heap_cap;
+    double inflation;
+    record_t *win_head, *win_tail;
+    size_t window_bytes, window_limit;
+    sketch_t sketch;
+    blkpool_t pool;
+    record_t *compact_head;
     size_t bytes_completed; 
+    size_t bytes_inflight;
     size_t soft_limit;
+    size_t low_mark, hard_limit;
+
+    pthread_t evictor;
+    pthread_mutex_t ev_m;
+    pthread_cond_t ev_wake, ev_done;
+    int ev_kicked, ev_stop, has_evictor;
 
-    volatile size_t hits, misses, stores, evicts;
+    volatile size_t hits, misses, stores, evicts, stalls, admits, rejects;
+    volatile size_t hit_bytes, fetch_bytes;
+    volatile size_t compacted, compact_saved, compact_files;
 } cache_t;
 
-int cache_init(cache_t *c, size_t nbuckets, size_t soft);
+int cache_init(cache_t *c, size_t nshards, size_t soft);
 void cache_destroy(cache_t *c);
 
 typedef struct {
@@ -28,19 +78,57 @@ typedef struct {
     int is_fetcher;
 } cache_acquire_t;
 
-int cache_acquire(cache_t *c, const char *key, cache_acquire_t *out);
+/* A key is the concatenation head||tail; h must be
+   hscan_key_hash(head, head_len, tail, tail_len). */
+typedef struct {
+    const char *head;
+    size_t head_len;
+    const char *tail;
+    size_t tail_len;
+    uint64_t h;
+} cache_key_t;
+
+int cache_acquire(cache_t *c, const cache_key_t *key, cache_acquire_t *out);
 
+void cache_retain(record_t *r);
 void cache_release(record_t *r);
 
 int rec_append(cache_t *c, record_t *r, const void *buf, size_t n);
+void *rec_reserve(cache_t *c, record_t *r, size_t *len);
+int rec_commit(record_t *r, size_t n);
 
+void rec_declare_length(record_t *r, size_t n);
+void rec_flush(record_t *r);
 void rec_finish(cache_t *c, record_t *r);
 void rec_cancel(cache_t *c, record_t *r);
 
 size_t rec_wait_chunk(record_t *r, size_t *off, const void **ptr, size_t *len, int *done, int *canceled);
+size_t rec_poll_chunk(record_t *r, size_t *off, const void **ptr, size_t *len, int *done, int *canceled, rec_waiter_t *w);
+void rec_waiter_cancel(record_t *r, rec_waiter_t *w);
+
+void rec_cursor_attach(record_t *r, rec_cursor_t *cur);
+void rec_cursor_move(record_t *r, rec_cursor_t *cur, size_t at);
+void rec_cursor_detach(record_t *r, rec_cursor_t *cur);
+void rec_cursor_can_take(rec_cursor_t *cur, int yes);
+int rec_window(cache_t *c, record_t *r, rec_waiter_t *w);
+int rec_window_wait(cache_t *c, record_t *r);
+
+void rec_forget(cache_t *c, record_t *r);
+int rec_pass(cache_t *c, record_t *r, int fd, size_t left, int reuse);
+int rec_passing(record_t *r);
+int rec_take_pass(record_t *r, size_t *left, int *reuse);
+
+void rec_tee_open(record_t *r);
+int rec_teeing(record_t *r);
+int rec_tapped(record_t *r);
+int rec_tap_attach(record_t *r, rec_tap_t *t);
+void rec_tap_wait(rec_tap_t *t);
+rec_tap_t **rec_taps(record_t *r);
+void rec_tap_release(rec_tap_t *t);
 
-void rec_touch_lru(cache_t *c, record_t *r);
+void rec_touch(cache_t *c, record_t *r);
 
 const char* rec_key(record_t *r);
 size_t rec_size(record_t *r);
+int rec_file(record_t *r);
 int rec_is_completed(record_t *r);
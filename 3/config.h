@@ -2,15 +2,55 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define N_BUCKETS 4096
+#define INDEX_SHARDS 256
+#define INDEX_INIT_GROUPS 4
+#define HTAB_MIGRATE_GROUPS 2
 #define BLOCK_SZ (64*1024)
+#define REC_INLINE 512
+#define SEG_MIN 1024
+#define COMPACT_MAX (4ULL<<20)
+#define REC_MEMFD 1
+#define MEMFD_MIN (256*1024)
+#define BYPASS_BYTES (256ULL<<20)
+#define REC_WAKE_BYTES (16*1024)
+#define REC_WINDOW (4*1024*1024)
+#define TEE_PIPE_SZ (1024*1024)
 #define SOFT_LIMIT_BYTES (1024ULL<<20) 
+#define EVICT_LOW_PCT 90
+#define HARD_LIMIT_PCT 125
+#define EVICT_STALL_MS 100
+#define WINDOW_PCT 1
+#define SKETCH_WIDTH (1<<16)
+#define BLKPOOL_ARENA_BLOCKS 32
+#define BLKPOOL_BATCH 16
+#define BLKPOOL_TCACHE 64
+#define BLKPOOL_KEEP_BYTES (64ULL<<20)
+#define BLKPOOL_THP 0
 
 #define WORKERS 4
+#define SHARDS 0
 #define QUEUE_CAP 1000
 #define PROXY_PORT 8080
 #define LISTEN_BACKLOG 512
 
 #define CONNECT_TIMEOUT_MS 5000
+#define RESOLVE_TIMEOUT_MS 5000
 #define IDLE_RW_MS 30000
-#define FIRST_BYTE_MS 10000
\ No newline at end of file
+#define FIRST_BYTE_MS 10000
+#define KEEPALIVE_IDLE_MS 5000
+
+#define UPOOL_BUCKETS 64
+#define UPOOL_PER_HOST 32
+#define UPOOL_IDLE_MS 15000
+
+#define REQ_BUF_SZ 8192
+#define RESP_HEAD_MAX 8192
+#define EPOLL_BATCH 64
+#define REACTOR_IO_BUDGET 16
+#define SWEEP_INTERVAL_MS 1000
+#define STATS_INTERVAL_MS 10000
+
+#define URING_ENTRIES 64
+#define URING_NBUFS 16
+#define URING_BUF_SZ BLOCK_SZ
+#define URING_CHAIN_MAX 16
@@ -0,0 +1,239 @@
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+#include "hscan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HSCAN_X86 1
+#endif
+
+typedef const char *(*head_end_fn)(const char *p, size_t len);
+typedef const char *(*line_fn)(const char *p, const char *end, const char **colon);
+
+static const char *head_end_scalar_from(const char *p, size_t i, size_t len) {
+    for (; i + 3 < len; i++)
+        if (p[i] == '\r' && p[i + 1] == '\n' && p[i + 2] == '\r' && p[i + 3] == '\n')
+            return p + i + 4;
+    return NULL;
+}
+
+static const char *head_end_scalar(const char *p, size_t len) {
+    return head_end_scalar_from(p, 0, len);
+}
+
+static const char *line_scalar_from(const char *p, const char *end, const char **colon, const char *c) {
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            *colon = c;
+            return p;
+        }
+        if (*p == ':' && !c)
+            c = p;
+    }
+    *colon = c;
+    return NULL;
+}
+
+static const char *line_scalar(const char *p, const char *end, const char **colon) {
+    return line_scalar_from(p, end, colon, NULL);
+}
+
+#ifdef HSCAN_X86
+/* A match needs "\r\n\r\n" at i, so compare four shifted loads against the
+   pattern bytes and AND the results: every set bit is a terminator. */
+static const char *head_end_sse2(const char *p, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 3 + 16 <= len; i += 16) {
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i + 1)), lf)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i + 2)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + i + 3)), lf)));
+        unsigned bits = (unsigned) _mm_movemask_epi8(m);
+        if (bits)
+            return p + i + (size_t) __builtin_ctz(bits) + 4;
+    }
+    return head_end_scalar_from(p, i, len);
+}
+
+static const char *line_sse2(const char *p, const char *end, const char **colon) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i col = _mm_set1_epi8(':');
+    const char *c = NULL;
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        unsigned nl = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        if (!c) {
+            unsigned cm = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, col));
+            if (nl)
+                cm &= (nl & -nl) - 1;
+            if (cm)
+                c = p + __builtin_ctz(cm);
+        }
+        if (nl) {
+            *colon = c;
+            return p + __builtin_ctz(nl);
+        }
+    }
+    return line_scalar_from(p, end, colon, c);
+}
+
+__attribute__((target("avx2")))
+static const char *head_end_avx2(const char *p, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 3 + 32 <= len; i += 32) {
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i + 1)), lf)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i + 2)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + i + 3)), lf)));
+        unsigned bits = (unsigned) _mm256_movemask_epi8(m);
+        if (bits)
+            return p + i + (size_t) __builtin_ctz(bits) + 4;
+    }
+    return head_end_sse2(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *line_avx2(const char *p, const char *end, const char **colon) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i col = _mm256_set1_epi8(':');
+    const char *c = NULL;
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        unsigned nl = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        if (!c) {
+            unsigned cm = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, col));
+            if (nl)
+                cm &= (nl & -nl) - 1;
+            if (cm)
+                c = p + __builtin_ctz(cm);
+        }
+        if (nl) {
+            *colon = c;
+            return p + __builtin_ctz(nl);
+        }
+    }
+    return line_scalar_from(p, end, colon, c);
+}
+#endif
+
+static head_end_fn head_end_impl = head_end_scalar;
+static line_fn line_impl = line_scalar;
+static const char *impl_name = "scalar";
+
+__attribute__((constructor))
+static void hscan_pick(void) {
+#ifdef HSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        head_end_impl = head_end_avx2;
+        line_impl = line_avx2;
+        impl_name = "avx2";
+    } else {
+        head_end_impl = head_end_sse2;
+        line_impl = line_sse2;
+        impl_name = "sse2";
+    }
+#endif
+}
+
+const char *hscan_head_end(const char *p, size_t len) {
+    return head_end_impl(p, len);
+}
+
+const char *hscan_line(const char *p, const char *end, const char **colon) {
+    return line_impl(p, end, colon);
+}
+
+const char *hscan_impl_name(void) {
+    return impl_name;
+}
+
+/* (len + lowercase first byte) & 31 is collision-free over the names
+   below; a hit still needs a full case-insensitive compare. */
+static const struct {
+    const char *name;
+    unsigned char len;
+    unsigned char id;
+} hdr_table[32] = {
+    [0]  = { "proxy-connection", 16, HDR_PROXY_CONNECTION },
+    [5]  = { "transfer-encoding", 17, HDR_TRANSFER_ENCODING },
+    [12] = { "host", 4, HDR_HOST },
+    [13] = { "connection", 10, HDR_CONNECTION },
+    [16] = { "cache-control", 13, HDR_CACHE_CONTROL },
+    [17] = { "content-length", 14, HDR_CONTENT_LENGTH },
+    [21] = { "keep-alive", 10, HDR_KEEP_ALIVE },
+    [28] = { "upgrade", 7, HDR_UPGRADE },
+};
+
+int hscan_header_id(const char *name, size_t len) {
+    if (!len || len > 32)
+        return HDR_OTHER;
+    unsigned h = (unsigned) (len + ((unsigned char) name[0] | 0x20)) & 31;
+    if (hdr_table[h].len != len || strncasecmp(name, hdr_table[h].name, len) != 0)
+        return HDR_OTHER;
+    return hdr_table[h].id;
+}
+
+#define KH_K0 0xa0761d6478bd642fULL
+#define KH_K1 0xe7037ed1a0b428dbULL
+#define KH_K2 0x8ebc6af09c88c6e3ULL
+
+static uint64_t kh_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static uint64_t kh_load(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/* Copies n bytes at offset off of the concatenation a||b into dst. */
+static void kh_gather(unsigned char *dst, const char *a, size_t alen, const char *b,
+                      size_t off, size_t n) {
+    if (off < alen) {
+        size_t k = alen - off < n ? alen - off : n;
+        memcpy(dst, a + off, k);
+        dst += k;
+        n -= k;
+        off += k;
+    }
+    if (n)
+        memcpy(dst, b + (off - alen), n);
+}
+
+/* Hashes a||b as one string, 16 bytes per round folded through two 64-bit
+   lanes; only a block straddling the seam is copied. The zero-padded tail is
+   unambiguous because the total length seeds the state. */
+uint64_t hscan_key_hash(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t len = alen + blen;
+    uint64_t s = kh_mix(len ^ KH_K0, KH_K1);
+    unsigned char tmp[16];
+    size_t off = 0;
+
+    for (; len - off > 16; off += 16) {
+        const unsigned char *p;
+        if (off + 16 <= alen)
+            p = (const unsigned char *) a + off;
+        else if (off >= alen)
+            p = (const unsigned char *) b + (off - alen);
+        else {
+            kh_gather(tmp, a, alen, b, off, 16);
+            p = tmp;
+        }
+        s = kh_mix(kh_load(p) ^ KH_K1, kh_load(p + 8) ^ s);
+    }
+
+    memset(tmp, 0, sizeof tmp);
+    kh_gather(tmp, a, alen, b, off, len - off);
+    return kh_mix(kh_mix(kh_load(tmp) ^ KH_K2, kh_load(tmp + 8) ^ s), len ^ KH_K1);
+}
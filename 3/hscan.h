@@ -0,0 +1,21 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+    HDR_OTHER,
+    HDR_HOST,
+    HDR_CONNECTION,
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_CONTENT_LENGTH,
+    HDR_TRANSFER_ENCODING,
+    HDR_UPGRADE,
+    HDR_CACHE_CONTROL
+};
+
+const char *hscan_head_end(const char *p, size_t len);
+const char *hscan_line(const char *p, const char *end, const char **colon);
+int hscan_header_id(const char *name, size_t len);
+const char *hscan_impl_name(void);
+uint64_t hscan_key_hash(const char *a, size_t alen, const char *b, size_t blen);
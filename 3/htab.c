@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "htab.h"
+#include "config.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Open addressing in groups of 16 slots. Each slot has a control byte:
+   empty, deleted, or the top 7 bits of its hash, so a probe compares a
+   whole group's tags at once and touches a slot only on a tag match. */
+#define GROUP 16
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+typedef struct htab_slot {
+    uint64_t h;
+    void *val;
+} htab_slot_t;
+
+typedef struct htab_tbl {
+    size_t ngroups;
+    size_t used, tombs;
+    int8_t *ctrl;
+    htab_slot_t *slots;
+} htab_tbl_t;
+
+static int8_t tag_of(uint64_t h) {
+    return (int8_t) (h >> 57);
+}
+
+#if defined(__SSE2__)
+static unsigned group_match(const int8_t *g, int8_t v) {
+    __m128i c = _mm_load_si128((const __m128i *) g);
+    return (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(v)));
+}
+
+static unsigned group_free(const int8_t *g) {
+    return (unsigned) _mm_movemask_epi8(_mm_load_si128((const __m128i *) g));
+}
+#else
+static unsigned group_match(const int8_t *g, int8_t v) {
+    unsigned m = 0;
+    for (int i = 0; i < GROUP; i++)
+        m |= (unsigned) (g[i] == v) << i;
+    return m;
+}
+
+static unsigned group_free(const int8_t *g) {
+    unsigned m = 0;
+    for (int i = 0; i < GROUP; i++)
+        m |= (unsigned) (g[i] < 0) << i;
+    return m;
+}
+#endif
+
+static htab_tbl_t *tbl_new(size_t ngroups) {
+    htab_tbl_t *t = malloc(sizeof *t);
+    if (!t)
+        return NULL;
+    t->ngroups = ngroups;
+    t->used = t->tombs = 0;
+    t->ctrl = aligned_alloc(GROUP, ngroups * GROUP);
+    t->slots = malloc(ngroups * GROUP * sizeof *t->slots);
+    if (!t->ctrl || !t->slots) {
+        free(t->ctrl);
+        free(t->slots);
+        free(t);
+        return NULL;
+    }
+    memset(t->ctrl, CTRL_EMPTY, ngroups * GROUP);
+    return t;
+}
+
+static void tbl_free(htab_tbl_t *t) {
+    if (!t)
+        return;
+    free(t->ctrl);
+    free(t->slots);
+    free(t);
+}
+
+static size_t tbl_cap(const htab_tbl_t *t) {
+    return t->ngroups * GROUP;
+}
+
+/* Triangular steps over a power-of-two group count visit every group. */
+static htab_slot_t *tbl_find(htab_tbl_t *t, uint64_t h, htab_eq_fn eq, const void *key) {
+    size_t mask = t->ngroups - 1;
+    size_t g = (size_t) h & mask;
+    int8_t tag = tag_of(h);
+    for (size_t step = 1; step <= t->ngroups; step++) {
+        const int8_t *ctrl = t->ctrl + g * GROUP;
+        unsigned m = group_match(ctrl, tag);
+        while (m) {
+            size_t i = g * GROUP + (size_t) __builtin_ctz(m);
+            if (t->slots[i].h == h && eq(t->slots[i].val, key))
+                return &t->slots[i];
+            m &= m - 1;
+        }
+        if (group_match(ctrl, CTRL_EMPTY))
+            return NULL;
+        g = (g + step) & mask;
+    }
+    return NULL;
+}
+
+static int tbl_put(htab_tbl_t *t, uint64_t h, void *val) {
+    size_t mask = t->ngroups - 1;
+    size_t g = (size_t) h & mask;
+    for (size_t step = 1; step <= t->ngroups; step++) {
+        unsigned m = group_free(t->ctrl + g * GROUP);
+        if (m) {
+            size_t i = g * GROUP + (size_t) __builtin_ctz(m);
+            if (t->ctrl[i] == CTRL_DELETED)
+                t->tombs--;
+            t->ctrl[i] = tag_of(h);
+            t->slots[i].h = h;
+            t->slots[i].val = val;
+            t->used++;
+            return 0;
+        }
+        g = (g + step) & mask;
+    }
+    return -1;
+}
+
+static void tbl_erase(htab_tbl_t *t, htab_slot_t *s) {
+    t->ctrl[s - t->slots] = CTRL_DELETED;
+    t->used--;
+    t->tombs++;
+}
+
+static int same_val(const void *val, const void *key) {
+    return val == key;
+}
+
+/* Moves a few old groups per call. Migrated slots become tombstones, not
+   empties, so probes for entries still in the old table walk past them. */
+static int migrate_step(htab_t *t, size_t groups) {
+    htab_tbl_t *o = t->old;
+    while (groups-- && t->mig < o->ngroups) {
+        size_t base = t->mig * GROUP;
+        for (size_t i = base; i < base + GROUP; i++) {
+            if (o->ctrl[i] < 0)
+                continue;
+            if (tbl_put(t->cur, o->slots[i].h, o->slots[i].val))
+                return -1;
+            tbl_erase(o, &o->slots[i]);
+        }
+        t->mig++;
+    }
+    if (t->mig == o->ngroups) {
+        tbl_free(o);
+        t->old = NULL;
+    }
+    return 0;
+}
+
+/* Grows (or, when tombstones dominate, rebuilds at the same size) into a
+   fresh table that is filled incrementally by later operations, so no
+   single lookup pays for copying the whole shard. */
+static int start_resize(htab_t *t) {
+    htab_tbl_t *c = t->cur;
+    size_t ng = c->used * 16 >= tbl_cap(c) * 7 ? c->ngroups * 2 : c->ngroups;
+    htab_tbl_t *n = tbl_new(ng);
+    if (!n)
+        return -1;
+    t->old = c;
+    t->cur = n;
+    t->mig = 0;
+    return 0;
+}
+
+int htab_init(htab_t *t, size_t ngroups) {
+    if (!ngroups || (ngroups & (ngroups - 1)))
+        return -1;
+    t->cur = tbl_new(ngroups);
+    t->old = NULL;
+    t->mig = 0;
+    return t->cur ? 0 : -1;
+}
+
+void htab_destroy(htab_t *t) {
+    tbl_free(t->cur);
+    tbl_free(t->old);
+    t->cur = t->old = NULL;
+}
+
+void *htab_find(htab_t *t, uint64_t h, htab_eq_fn eq, const void *key) {
+    if (t->old)
+        migrate_step(t, HTAB_MIGRATE_GROUPS);
+    htab_slot_t *s = tbl_find(t->cur, h, eq, key);
+    if (!s && t->old)
+        s = tbl_find(t->old, h, eq, key);
+    return s ? s->val : NULL;
+}
+
+int htab_insert(htab_t *t, uint64_t h, void *val) {
+    htab_tbl_t *c = t->cur;
+    if ((c->used + c->tombs + 1) * 8 > tbl_cap(c) * 7) {
+        /* A new table has room for at least 7 more entries per old group
+           than the old one held, and each insert moves a group, so it
+           cannot fill up mid-migration; finishing the move in one go here
+           is only a guard. */
+        if (t->old && migrate_step(t, t->old->ngroups))
+            return -1;
+        if (start_resize(t))
+            return -1;
+    } else if (t->old) {
+        migrate_step(t, HTAB_MIGRATE_GROUPS);
+    }
+    return tbl_put(t->cur, h, val);
+}
+
+int htab_remove(htab_t *t, uint64_t h, const void *val) {
+    htab_slot_t *s = tbl_find(t->cur, h, same_val, val);
+    if (s) {
+        tbl_erase(t->cur, s);
+    } else if (t->old && (s = tbl_find(t->old, h, same_val, val))) {
+        tbl_erase(t->old, s);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void htab_each(htab_t *t, void (*fn)(void *val, void *arg), void *arg) {
+    htab_tbl_t *tabs[2] = { t->cur, t->old };
+    for (int k = 0; k < 2; k++) {
+        htab_tbl_t *x = tabs[k];
+        for (size_t i = 0; x && i < tbl_cap(x); i++)
+            if (x->ctrl[i] >= 0)
+                fn(x->slots[i].val, arg);
+    }
+}
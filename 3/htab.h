@@ -0,0 +1,18 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int (*htab_eq_fn)(const void *val, const void *key);
+
+typedef struct htab {
+    struct htab_tbl *cur, *old;
+    size_t mig;
+} htab_t;
+
+int   htab_init(htab_t *t, size_t ngroups);
+void  htab_destroy(htab_t *t);
+
+void *htab_find(htab_t *t, uint64_t h, htab_eq_fn eq, const void *key);
+int   htab_insert(htab_t *t, uint64_t h, void *val);
+int   htab_remove(htab_t *t, uint64_t h, const void *val);
+void  htab_each(htab_t *t, void (*fn)(void *val, void *arg), void *arg);
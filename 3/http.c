@@ -5,135 +5,556 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <strings.h>
+#include <sys/socket.h>
 
 #include "http.h"
+#include "hscan.h"
 #include "config.h"
 
-static ssize_t read_line(int fd, char *buf, size_t cap) {
-    size_t i = 0;
-    while (i + 1 < cap) {
-        char c;
-        ssize_t n = read(fd, &c, 1);
-        if (n == 0) 
-            return 0;
-        if (n < 0) {
-            if (errno == EINTR) 
-                continue;
-                
-            return -1;
-        }
+static int slice_eq(http_slice_t s, const char *lit) {
+    size_t n = strlen(lit);
+    return s.len == n && memcmp(s.p, lit, n) == 0;
+}
 
-        buf[i++] = c;
-        if (i >= 2 && buf[i - 2] == '\r' && buf[i - 1] == '\n') {
-            buf[i] = 0;
-            return (ssize_t) i;
-        }
-    }
-    buf[cap - 1] = 0;
-    return (ssize_t) i;
-}
-
-static int parse_url(const char *url, char *host, int *port, char *path) {
-    if (strncmp(url, "http://", 7) == 0) {
-        const char *p = url + 7;
-        const char *slash = strchr(p, '/');
-        const char *h_end = slash ? slash : (url + strlen(url));
-        const char *colon = memchr(p, ':', h_end - p);
-        if (colon) {
-            memcpy(host, p, colon - p);
-            host[colon - p] = 0;
-            *port = atoi(colon + 1);
-        } else {
-            memcpy(host, p, h_end - p);
-            host[h_end - p] = 0;
-            *port = 80;
+static http_slice_t trim(const char *p, const char *e) {
+    while (p < e && (*p == ' ' || *p == '\t'))
+        p++;
+    while (e > p && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r'))
+        e--;
+    return (http_slice_t) { p, (size_t)(e - p) };
+}
+
+/* The list element starting at p, trimmed and without any "=value" or
+   ";param" part. */
+static http_slice_t list_token(const char *p, const char *e) {
+    const char *c = memchr(p, ',', (size_t)(e - p));
+    const char *end = c ? c : e;
+    for (const char *q = p; q < end; q++)
+        if (*q == '=' || *q == ';') {
+            end = q;
+            break;
         }
+    return trim(p, end);
+}
 
-        if (slash) 
-            strcpy(path, slash);
-        else 
-            strcpy(path, "/");
-        return 0;
-    } else if (url[0] == '/') {
-        strcpy(path, url);
-        return 1;
+static int token_eq(http_slice_t t, const char *tok) {
+    size_t n = strlen(tok);
+    return t.len == n && strncasecmp(t.p, tok, n) == 0;
+}
+
+static int header_has_token(http_slice_t v, const char *tok) {
+    const char *p = v.p, *e = v.p + v.len;
+    while (p < e) {
+        if (token_eq(list_token(p, e), tok))
+            return 1;
+        const char *c = memchr(p, ',', (size_t)(e - p));
+        if (!c)
+            break;
+        p = c + 1;
     }
-    return -1;
+    return 0;
 }
 
-int http_parse_client_request(int fd, http_request_t *req) {
-    memset(req, 0, sizeof *req);
-    char line[4096];
-    ssize_t n = read_line(fd, line, sizeof line);
-    if (n <= 0) 
+static int header_last_token(http_slice_t v, const char *tok) {
+    const char *p = v.p, *e = v.p + v.len;
+    for (const char *c; (c = memchr(p, ',', (size_t)(e - p))); )
+        p = c + 1;
+    return token_eq(list_token(p, e), tok);
+}
+
+static int set_host(http_request_t *req, http_slice_t hp) {
+    const char *colon = memchr(hp.p, ':', hp.len);
+    size_t hl = colon ? (size_t)(colon - hp.p) : hp.len;
+    if (!hl || hl >= sizeof req->host)
         return -1;
-    char u[2048] = {0};
-    char m[16] = {0};
-    char v[16] = {0};
-    if (sscanf(line, "%7s %2047s %15s", m, u, v) != 3) 
-        return -2;
+    memcpy(req->host, hp.p, hl);
+    req->host[hl] = 0;
 
-    strcpy(req->method, m);
-    strcpy(req->url, u);
-    strcpy(req->version, v);
+    req->port = 80;
+    if (colon) {
+        int port = 0;
+        for (const char *d = colon + 1; d < hp.p + hp.len && *d >= '0' && *d <= '9' && port <= 65535; d++)
+            port = port * 10 + (*d - '0');
+        if (port < 1 || port > 65535)
+            return -1;
+        req->port = port;
+    }
+    return 0;
+}
 
-    if (strcmp(req->method, "GET") != 0) 
-        return -3;
+/* The cache key is origin + path; the origin is formatted here once and the
+   hash taken across both pieces, so neither is copied into a joined key. */
+static int set_key(http_request_t *req) {
+    char *o = req->origin;
+    size_t hl = strlen(req->host);
+    memcpy(o, "http://", 7);
+    memcpy(o + 7, req->host, hl);
+    size_t n = 7 + hl;
+    o[n++] = ':';
 
-    char host_from_hdr[1024] = {0};
-    while (1) {
-        n = read_line(fd, line, sizeof line);
-        if (n < 0) 
-            return -4;
-        if (n == 0) 
-            return -4;
-        if (strcmp(line, "\r\n") == 0) 
-            break;
-        if (strncasecmp(line, "Host:", 5) == 0) {
-            const char *p = line + 5;
-            while (*p == ' ' || *p == '\t') 
-                ++p;
-            size_t L = strcspn(p, "\r\n");
-            if (L > 0) {
-                if (L >= sizeof(host_from_hdr)) 
-                    L = sizeof(host_from_hdr) - 1;
-                memcpy(host_from_hdr, p, L);
-                host_from_hdr[L] = 0;
-            }
-        }
+    char d[12];
+    int k = 0;
+    unsigned port = (unsigned) req->port;
+    do {
+        d[k++] = (char) ('0' + port % 10);
+        port /= 10;
+    } while (port);
+    while (k)
+        o[n++] = d[--k];
+    o[n] = 0;
+
+    req->origin_len = n;
+    req->key_hash = hscan_key_hash(o, n, req->path.p, req->path.len);
+    return 0;
+}
+
+static int parse_request_line(const char *p, const char *e, http_request_t *req) {
+    http_slice_t *f[3] = { &req->method, &req->url, &req->version };
+    for (int i = 0; i < 3; i++) {
+        while (p < e && *p == ' ')
+            p++;
+        const char *t = p;
+        while (p < e && *p != ' ' && *p != '\r')
+            p++;
+        if (p == t)
+            return -2;
+        *f[i] = (http_slice_t) { t, (size_t)(p - t) };
     }
 
-    int r = parse_url(req->url, req->host, &req->port, req->path);
-    if (r == 0) {
-    } else if (r == 1) {
-        if (!*host_from_hdr) 
+    if (!slice_eq(req->method, "GET")) 
+        return -3;
+    return 0;
+}
+
+static int resolve_target(http_request_t *req, http_slice_t host_hdr, int conn_opt) {
+    req->http11 = slice_eq(req->version, "HTTP/1.1");
+    if (req->http11)
+        req->keep_alive = conn_opt >= 0;
+    else
+        req->keep_alive = conn_opt > 0;
+
+    const char *u = req->url.p;
+    const char *ue = u + req->url.len;
+    if (req->url.len > 7 && strncmp(u, "http://", 7) == 0) {
+        const char *hp = u + 7;
+        const char *slash = memchr(hp, '/', (size_t)(ue - hp));
+        const char *h_end = slash ? slash : ue;
+        if (set_host(req, (http_slice_t) { hp, (size_t)(h_end - hp) }))
+            return -6;
+        if (slash)
+            req->path = (http_slice_t) { slash, (size_t)(ue - slash) };
+        else
+            req->path = (http_slice_t) { "/", 1 };
+        return set_key(req);
+    }
+    if (u[0] == '/') {
+        if (!host_hdr.len) 
             return -5;
-        char *colon = strchr(host_from_hdr, ':');
-        if (colon) {
-            *colon = 0;
-            strcpy(req->host, host_from_hdr);
-            req->port = atoi(colon + 1);
-        } else {
-            strcpy(req->host, host_from_hdr);
-            req->port = 80;
+        if (set_host(req, host_hdr))
+            return -6;
+        req->path = req->url;
+        return set_key(req);
+    }
+    return -6;
+}
+
+static int parse_request_head(const char *buf, size_t len, http_request_t *req) {
+    const char *end = buf + len;
+    const char *nl = memchr(buf, '\n', len);
+    memset(req, 0, sizeof *req);
+    int rc = parse_request_line(buf, nl, req);
+    if (rc)
+        return rc;
+
+    http_slice_t host_hdr = { NULL, 0 };
+    int conn_opt = 0;
+    for (const char *p = nl + 1; p < end; ) {
+        const char *colon;
+        const char *e = hscan_line(p, end, &colon);
+        switch (colon ? hscan_header_id(p, (size_t)(colon - p)) : HDR_OTHER) {
+        case HDR_CONNECTION:
+        case HDR_PROXY_CONNECTION:
+            if (header_has_token(trim(colon + 1, e), "close"))
+                conn_opt = -1;
+            else if (header_has_token(trim(colon + 1, e), "keep-alive") && conn_opt == 0)
+                conn_opt = 1;
+            break;
+        case HDR_HOST:
+            host_hdr = trim(colon + 1, e);
+            break;
         }
-    } else {
-        return -6;
+        p = e + 1;
     }
 
-    return 0;
+    return resolve_target(req, host_hdr, conn_opt);
+}
+
+void http_reqbuf_init(http_reqbuf_t *rb) {
+    rb->len = rb->off = rb->scan = 0;
+    rb->eof = 0;
+}
+
+int http_reqbuf_parse(http_reqbuf_t *rb, http_request_t *req) {
+    const char *base = rb->buf + rb->off;
+    size_t avail = rb->len - rb->off;
+    size_t i = rb->scan > rb->off + 3 ? rb->scan - 3 - rb->off : 0;
+
+    const char *e = hscan_head_end(base + i, avail - i);
+    if (e) {
+        size_t n = (size_t)(e - base);
+        rb->off += n;
+        rb->scan = rb->off;
+        int rc = parse_request_head(base, n, req);
+        return rc ? rc : 1;
+    }
+
+    rb->scan = rb->len;
+    return avail >= sizeof rb->buf ? -4 : 0;
+}
+
+ssize_t http_reqbuf_fill(http_reqbuf_t *rb, int fd) {
+    if (rb->off) {
+        memmove(rb->buf, rb->buf + rb->off, rb->len - rb->off);
+        rb->len -= rb->off;
+        rb->scan -= rb->off;
+        rb->off = 0;
+    }
+
+    ssize_t n = recv(fd, rb->buf + rb->len, sizeof rb->buf - rb->len, 0);
+    if (n > 0)
+        rb->len += (size_t) n;
+    else if (n == 0)
+        rb->eof = 1;
+    return n;
+}
+
+int http_reqbuf_pending(const http_reqbuf_t *rb) {
+    return rb->len > rb->off;
+}
+
+int http_read_request(int fd, http_reqbuf_t *rb, http_request_t *req) {
+    while (1) {
+        int rc = http_reqbuf_parse(rb, req);
+        if (rc)
+            return rc > 0 ? 0 : rc;
+        if (rb->eof)
+            return http_reqbuf_pending(rb) ? -4 : -1;
+
+        ssize_t n = http_reqbuf_fill(rb, fd);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return http_reqbuf_pending(rb) ? -4 : -1;
+    }
 }
 
 int http_build_upstream_get(char *out, size_t cap, const http_request_t *req) {
     return snprintf(
         out,
         cap,
-        "GET %s HTTP/1.0\r\n"
+        "GET %.*s HTTP/1.1\r\n"
         "Host: %s\r\n"
-        "Connection: close\r\n"
+        "Connection: keep-alive\r\n"
         "User-Agent: Proxy/1.0\r\n"
         "\r\n",
-        req->path[0] ? req->path : "/",
-        req->host[0] ? req->host : ""
+        (int) req->path.len,
+        req->path.p,
+        req->host
     );
 }
+
+static int is_hop_header(const char *line, size_t len) {
+    const char *colon = memchr(line, ':', len);
+    if (!colon)
+        return 0;
+    switch (hscan_header_id(line, (size_t)(colon - line))) {
+    case HDR_CONNECTION:
+    case HDR_KEEP_ALIVE:
+    case HDR_PROXY_CONNECTION:
+    case HDR_TRANSFER_ENCODING:
+    case HDR_CONTENT_LENGTH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int http_parse_response_head(const char *buf, size_t len, http_response_t *rsp) {
+    memset(rsp, 0, sizeof *rsp);
+    rsp->content_length = -1;
+
+    const char *end = buf + len;
+    const char *nl = memchr(buf, '\n', len);
+    if (!nl || len < 12 || strncmp(buf, "HTTP/", 5) != 0)
+        return -1;
+    const char *sp = memchr(buf, ' ', (size_t)(nl - buf));
+    if (!sp)
+        return -1;
+    rsp->status = atoi(sp + 1);
+
+    int http11 = strncmp(buf, "HTTP/1.1", 8) == 0;
+    int conn_opt = 0;
+    int te = 0;
+    for (const char *p = nl + 1; p < end; ) {
+        const char *colon;
+        const char *e = hscan_line(p, end, &colon);
+        if (!e)
+            break;
+        switch (colon ? hscan_header_id(p, (size_t)(colon - p)) : HDR_OTHER) {
+        case HDR_CONTENT_LENGTH:
+            rsp->content_length = strtoll(colon + 1, NULL, 10);
+            break;
+        case HDR_TRANSFER_ENCODING:
+            // only a final chunked coding frames the body; any other runs to close
+            rsp->chunked = header_last_token(trim(colon + 1, e), "chunked");
+            te = 1;
+            break;
+        case HDR_CONNECTION:
+            if (header_has_token(trim(colon + 1, e), "close"))
+                conn_opt = -1;
+            else if (header_has_token(trim(colon + 1, e), "keep-alive") && conn_opt == 0)
+                conn_opt = 1;
+            break;
+        case HDR_CACHE_CONTROL:
+            if (header_has_token(trim(colon + 1, e), "no-store") || header_has_token(trim(colon + 1, e), "private"))
+                rsp->no_store = 1;
+            break;
+        }
+        p = e + 1;
+    }
+    rsp->keep_alive = http11 ? conn_opt >= 0 : conn_opt > 0;
+    if (te)
+        rsp->content_length = -1;
+
+    if ((rsp->status >= 100 && rsp->status < 200) || rsp->status == 204 || rsp->status == 304)
+        rsp->no_body = 1;
+    return 0;
+}
+
+int http_rewrite_response_head(char *out, size_t cap, const char *head, size_t len,
+                               long long content_length, int chunked, int keep_alive) {
+    const char *end = head + len;
+    const char *nl = memchr(head, '\n', len);
+    const char *sp = nl ? memchr(head, ' ', (size_t)(nl - head)) : NULL;
+    if (!sp)
+        return -1;
+
+    size_t o = 0;
+    size_t L = (size_t)(nl + 1 - sp);
+    if (8 + L >= cap)
+        return -1;
+    memcpy(out, "HTTP/1.1", 8);
+    memcpy(out + 8, sp, L);
+    o = 8 + L;
+
+    for (const char *p = nl + 1; p < end; ) {
+        const char *e = memchr(p, '\n', (size_t)(end - p));
+        if (!e)
+            break;
+        L = (size_t)(e + 1 - p);
+        if (L <= 2)
+            break;
+        if (!is_hop_header(p, L)) {
+            if (o + L >= cap)
+                return -1;
+            memcpy(out + o, p, L);
+            o += L;
+        }
+        p = e + 1;
+    }
+
+    int n;
+    if (content_length >= 0)
+        n = snprintf(out + o, cap - o, "Content-Length: %lld\r\n", content_length);
+    else if (chunked)
+        n = snprintf(out + o, cap - o, "Transfer-Encoding: chunked\r\n");
+    else
+        n = 0;
+    if (n < 0 || (size_t) n >= cap - o)
+        return -1;
+    o += (size_t) n;
+
+    n = snprintf(out + o, cap - o, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+    if (n < 0 || (size_t) n >= cap - o)
+        return -1;
+    return (int)(o + (size_t) n);
+}
+
+enum { FR_HEAD, FR_LENGTH, FR_EOF, FR_CHUNK_SIZE, FR_CHUNK_DATA, FR_CHUNK_END, FR_TRAILER, FR_DONE };
+
+void http_framer_init(http_framer_t *f) {
+    f->state = FR_HEAD;
+    f->head_have = 0;
+    f->remaining = 0;
+    f->line_len = 0;
+    f->keep_alive = 0;
+    f->bypass = 0;
+    f->expect = -1;
+}
+
+int http_framer_done(const http_framer_t *f) {
+    return f->state == FR_DONE;
+}
+
+static int framer_raw(http_framer_t *f, http_emit_fn emit, void *arg) {
+    f->state = FR_EOF;
+    f->keep_alive = 0;
+    return emit(arg, f->head, f->head_have);
+}
+
+static int framer_head_done(http_framer_t *f, size_t head_len, http_emit_fn emit, void *arg) {
+    http_response_t rsp;
+    if (http_parse_response_head(f->head, head_len, &rsp))
+        return framer_raw(f, emit, arg);
+
+    f->keep_alive = rsp.keep_alive;
+    f->bypass = rsp.no_store || rsp.content_length > (long long) BYPASS_BYTES;
+    if (rsp.chunked && !rsp.no_body) {
+        char out[RESP_HEAD_MAX + 256];
+        int n = http_rewrite_response_head(out, sizeof out, f->head, head_len, -1, 0, 0);
+        if (n < 0)
+            return framer_raw(f, emit, arg);
+        f->state = FR_CHUNK_SIZE;
+        f->line_len = 0;
+        return emit(arg, out, (size_t) n);
+    }
+
+    if (rsp.no_body || rsp.content_length == 0) {
+        f->state = FR_DONE;
+        f->expect = (long long) head_len;
+    } else if (rsp.content_length > 0) {
+        f->state = FR_LENGTH;
+        f->remaining = rsp.content_length;
+        f->expect = (long long) head_len + rsp.content_length;
+    } else {
+        f->state = FR_EOF;
+        f->keep_alive = 0;
+    }
+    return emit(arg, f->head, head_len);
+}
+
+static ssize_t framer_head(http_framer_t *f, const char *buf, size_t len, http_emit_fn emit, void *arg) {
+    size_t room = sizeof f->head - f->head_have;
+    size_t take = len < room ? len : room;
+    size_t from = f->head_have >= 3 ? f->head_have - 3 : 0;
+    memcpy(f->head + f->head_have, buf, take);
+    f->head_have += take;
+
+    const char *e = hscan_head_end(f->head + from, f->head_have - from);
+    if (e) {
+        size_t head_len = (size_t)(e - f->head);
+        size_t used = take - (f->head_have - head_len);
+        f->head_have = head_len;
+        return framer_head_done(f, head_len, emit, arg) ? -1 : (ssize_t) used;
+    }
+    if (f->head_have == sizeof f->head)
+        return framer_raw(f, emit, arg) ? -1 : (ssize_t) take;
+    return (ssize_t) take;
+}
+
+static int framer_line(http_framer_t *f, const char **p, const char *end) {
+    while (*p < end) {
+        char c = *(*p)++;
+        if (c == '\n')
+            return 1;
+        if (c != '\r' && f->line_len + 1 < sizeof f->line)
+            f->line[f->line_len++] = c;
+    }
+    return 0;
+}
+
+int http_framer_feed(http_framer_t *f, const char *buf, size_t len, http_emit_fn emit, void *arg) {
+    const char *p = buf;
+    const char *end = buf + len;
+    while (p < end && f->state != FR_DONE) {
+        size_t avail = (size_t)(end - p);
+        switch (f->state) {
+        case FR_HEAD: {
+            ssize_t used = framer_head(f, p, avail, emit, arg);
+            if (used < 0)
+                return -1;
+            p += used;
+            break;
+        }
+        case FR_EOF:
+            if (emit(arg, p, avail))
+                return -1;
+            p = end;
+            break;
+        case FR_LENGTH:
+        case FR_CHUNK_DATA: {
+            size_t n = (long long) avail < f->remaining ? avail : (size_t) f->remaining;
+            if (emit(arg, p, n))
+                return -1;
+            p += n;
+            f->remaining -= (long long) n;
+            if (!f->remaining)
+                f->state = f->state == FR_LENGTH ? FR_DONE : FR_CHUNK_END;
+            break;
+        }
+        case FR_CHUNK_SIZE:
+            if (!framer_line(f, &p, end))
+                break;
+            f->line[f->line_len] = 0;
+            if (!isxdigit((unsigned char) f->line[0]))
+                return -1;
+            f->remaining = strtoll(f->line, NULL, 16);
+            f->line_len = 0;
+            if (f->remaining < 0)
+                return -1;
+            f->state = f->remaining ? FR_CHUNK_DATA : FR_TRAILER;
+            break;
+        case FR_CHUNK_END:
+            if (framer_line(f, &p, end)) {
+                f->line_len = 0;
+                f->state = FR_CHUNK_SIZE;
+            }
+            break;
+        case FR_TRAILER:
+            if (!framer_line(f, &p, end))
+                break;
+            if (!f->line_len)
+                f->state = FR_DONE;
+            f->line_len = 0;
+            break;
+        }
+    }
+
+    if (f->state != FR_DONE)
+        return 0;
+    if (p < end)
+        f->keep_alive = 0;
+    return 1;
+}
+
+/* How many of the next bytes are body to be stored as they are, so the
+   caller may receive them straight into storage; 0 when they need the
+   framer. */
+size_t http_framer_direct(const http_framer_t *f) {
+    switch (f->state) {
+    case FR_EOF:
+        return SIZE_MAX;
+    case FR_LENGTH:
+    case FR_CHUNK_DATA:
+        return (size_t) f->remaining;
+    default:
+        return 0;
+    }
+}
+
+/* Accounts for n bytes taken directly; returns 1 once the body is done. */
+int http_framer_direct_done(http_framer_t *f, size_t n) {
+    if (f->state == FR_EOF)
+        return 0;
+    f->remaining -= (long long) n;
+    if (!f->remaining)
+        f->state = f->state == FR_LENGTH ? FR_DONE : FR_CHUNK_END;
+    return f->state == FR_DONE;
+}
+
+int http_framer_eof(http_framer_t *f, http_emit_fn emit, void *arg) {
+    f->keep_alive = 0;
+    if (f->state == FR_HEAD && f->head_have)
+        return framer_raw(f, emit, arg);
+    return 0;
+}
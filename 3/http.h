@@ -1,14 +1,74 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+typedef struct {
+    const char *p;
+    size_t len;
+} http_slice_t;
 
 typedef struct {
-    char method[8];
-    char url[2048];
-    char version[16];
-    char host[1024];
+    http_slice_t method;
+    http_slice_t url;
+    http_slice_t version;
+    http_slice_t path;
+    char host[256];
     int  port;
-    char path[2048];
+    char origin[280];
+    size_t origin_len;
+    uint64_t key_hash;
+    int  http11;
+    int  keep_alive;
 } http_request_t;
 
-int http_parse_client_request(int fd, http_request_t *req);
+typedef struct {
+    char buf[REQ_BUF_SZ];
+    size_t len;
+    size_t off;
+    size_t scan;
+    int eof;
+} http_reqbuf_t;
+
+typedef struct {
+    int status;
+    long long content_length;
+    int chunked;
+    int no_body;
+    int no_store;
+    int keep_alive;
+} http_response_t;
+
+typedef int (*http_emit_fn)(void *arg, const void *buf, size_t len);
+
+typedef struct {
+    int state;
+    char head[RESP_HEAD_MAX];
+    size_t head_have;
+    long long remaining;
+    char line[64];
+    size_t line_len;
+    int keep_alive;
+    int bypass;
+    long long expect;
+} http_framer_t;
+
+void    http_reqbuf_init(http_reqbuf_t *rb);
+int     http_reqbuf_parse(http_reqbuf_t *rb, http_request_t *req);
+ssize_t http_reqbuf_fill(http_reqbuf_t *rb, int fd);
+int     http_reqbuf_pending(const http_reqbuf_t *rb);
+int     http_read_request(int fd, http_reqbuf_t *rb, http_request_t *req);
+
 int http_build_upstream_get(char *out, size_t cap, const http_request_t *req);
+int http_parse_response_head(const char *buf, size_t len, http_response_t *rsp);
+int http_rewrite_response_head(char *out, size_t cap, const char *head, size_t len,
+                               long long content_length, int chunked, int keep_alive);
+
+void http_framer_init(http_framer_t *f);
+int  http_framer_feed(http_framer_t *f, const char *buf, size_t len, http_emit_fn emit, void *arg);
+int  http_framer_eof(http_framer_t *f, http_emit_fn emit, void *arg);
+int  http_framer_done(const http_framer_t *f);
+size_t http_framer_direct(const http_framer_t *f);
+int  http_framer_direct_done(http_framer_t *f, size_t n);
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "proxy.h"
 #include "config.h"
@@ -12,12 +13,36 @@ volatile sig_atomic_t stop_flag = 0;
 static void on_sigint(int s) {
     (void)s;
     stop_flag = 1;
-    close(gpx.listen_fd);
+    proxy_wakeup(&gpx);
 }
 
-int main() {
+static int parse_mode(int argc, char **argv) {
+    int mode = PROXY_MODE_EPOLL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") != 0 || i + 1 >= argc)
+            return -1;
+        const char *m = argv[++i];
+        if (strcmp(m, "epoll") == 0)
+            mode = PROXY_MODE_EPOLL;
+        else if (strcmp(m, "threads") == 0)
+            mode = PROXY_MODE_THREADS;
+        else if (strcmp(m, "uring") == 0)
+            mode = PROXY_MODE_URING;
+        else
+            return -1;
+    }
+    return mode;
+}
+
+int main(int argc, char **argv) {
+    int mode = parse_mode(argc, argv);
+    if (mode < 0) {
+        fprintf(stderr, "usage: %s [-m epoll|threads|uring]\n", argv[0]);
+        return 1;
+    }
+
     signal(SIGPIPE, SIG_IGN);
-    if (proxy_init(&gpx, PROXY_PORT, WORKERS)) {
+    if (proxy_init(&gpx, PROXY_PORT, WORKERS, mode)) {
         log_err("init failed");
         return 1;
     }
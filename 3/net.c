@@ -8,6 +8,7 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <fcntl.h>
 
 #include "net.h"
 #include "config.h"
@@ -30,6 +31,13 @@ int set_timeouts(int fd, int rcv_ms, int snd_ms) {
     return 0;
 }
 
+int set_nonblock(int fd) {
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
 int net_listen(int port) {
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -61,18 +69,39 @@ int net_listen(int port) {
     return fd;
 }
 
-int net_connect_host(const char *host, int port, int connect_timeout_ms) {
+int net_resolve(const char *host, int port, struct addrinfo **res) {
     char portstr[16];
     snprintf(portstr, sizeof portstr, "%d", port);
 
     struct addrinfo hints = {0};
-    struct addrinfo *res = NULL;
-    struct addrinfo *rp = NULL;
-
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
 
-    if (getaddrinfo(host, portstr, &hints, &res) != 0) 
+    *res = NULL;
+    if (getaddrinfo(host, portstr, &hints, res) != 0)
+        return -1;
+    return 0;
+}
+
+int net_connect_start(const struct addrinfo *ai) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0)
+        return -1;
+    if (set_nonblock(fd)) {
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+        return fd;
+    close(fd);
+    return -1;
+}
+
+int net_connect_host(const char *host, int port, int connect_timeout_ms) {
+    struct addrinfo *res = NULL;
+    struct addrinfo *rp = NULL;
+
+    if (net_resolve(host, port, &res))
         return -1;
 
     int fd = -1;
@@ -1,4 +1,9 @@
 #pragma once
+struct addrinfo;
+
 int net_listen(int port);
 int net_connect_host(const char *host, int port, int connect_timeout_ms);
-int set_timeouts(int fd, int rcv_ms, int snd_ms);
\ No newline at end of file
+int net_resolve(const char *host, int port, struct addrinfo **res);
+int net_connect_start(const struct addrinfo *ai);
+int set_timeouts(int fd, int rcv_ms, int snd_ms);
+int set_nonblock(int fd);
@@ -1,23 +1,34 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <stdio.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "proxy.h"
 #include "config.h"
 #include "net.h"
 #include "http.h"
 #include "logger.h"
+#include "uring.h"
+#include "resp.h"
+#include "upool.h"
+#include "hscan.h"
 
 extern volatile sig_atomic_t stop_flag;
 
 typedef struct {
-    proxy_ctx_t *px;
+    shard_t *sh;
     int client_fd;
     struct sockaddr_in addr;
 } client_job_t;
@@ -59,98 +70,363 @@ static int send_all(int fd, const void *buf, size_t n) {
     return 0;
 }
 
-static int stream_reader_to_client(record_t *r, int fd) {
-    size_t off = 0;
+static int sendfile_all(int fd, int in_fd, size_t off, size_t n) {
+    off_t o = (off_t) off;
+    while (n) {
+        ssize_t w = sendfile(fd, in_fd, &o, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (w == 0)
+            return -1;
+        n -= (size_t) w;
+    }
+    return 0;
+}
+
+static pthread_key_t tee_key;
+static pthread_once_t tee_once = PTHREAD_ONCE_INIT;
+
+static void tee_pipe_free(void *p) {
+    int *fds = (int *) p;
+    close(fds[0]);
+    close(fds[1]);
+    free(fds);
+}
+
+static void tee_key_init(void) {
+    pthread_key_create(&tee_key, tee_pipe_free);
+}
+
+/* Each worker moves spliced bodies through one pipe, left empty between
+   uses. */
+static int *worker_pipe(void) {
+    pthread_once(&tee_once, tee_key_init);
+    int *p = pthread_getspecific(tee_key);
+    if (p)
+        return p;
+
+    p = malloc(2 * sizeof *p);
+    if (!p || pipe2(p, O_CLOEXEC)) {
+        free(p);
+        return NULL;
+    }
+    pthread_setspecific(tee_key, p);
+    return p;
+}
+
+// a pipe left holding bytes cannot serve the next body
+static void worker_pipe_drop(int *p) {
+    tee_pipe_free(p);
+    pthread_setspecific(tee_key, NULL);
+}
+
+/* Parks the reader on the fetcher's tee until it falls behind or the body
+   ends, then lets it carry on from the cache past what the tee sent. */
+static int tap_live(record_t *r, int fd, resp_writer_t *w) {
+    rec_tap_t t = { .fd = fd, .at = w->off };
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || pipe2(t.pipe, O_CLOEXEC | O_NONBLOCK))
+        return -1;
+    (void) fcntl(t.pipe[1], F_SETPIPE_SZ, TEE_PIPE_SZ);
+    int rc = fcntl(fd, F_SETFL, fl | O_NONBLOCK) ? -1 : rec_tap_attach(r, &t);
+    if (rc == 0)
+        rec_tap_wait(&t);
+    fcntl(fd, F_SETFL, fl);
+    close(t.pipe[0]);
+    close(t.pipe[1]);
+    if (rc == 0)
+        resp_delivered(w, t.sent);
+    return rc;
+}
+
+/* Moves the rest of a body the fetcher handed over with rec_pass from
+   upstream to the client through the worker's pipe; it never reaches the
+   cache. */
+static int pass_to_client(proxy_ctx_t *px, const http_request_t *req, record_t *r, int fd, resp_writer_t *w) {
+    size_t left;
+    int reuse;
+    int us = rec_take_pass(r, &left, &reuse);
+    if (us < 0)
+        return -1;
+
+    int *p = worker_pipe();
+    size_t moved = 0;
+    while (p && moved < left) {
+        size_t want = left - moved < BLOCK_SZ ? left - moved : BLOCK_SZ;
+        ssize_t n = splice(us, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        for (ssize_t out = 0; out < n;) {
+            ssize_t k = splice(p[0], NULL, fd, NULL, (size_t) (n - out), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (k < 0 && errno == EINTR)
+                continue;
+            if (k <= 0) {
+                worker_pipe_drop(p);
+                p = NULL;
+                break;
+            }
+            out += k;
+            moved += (size_t) k;
+        }
+    }
+
+    resp_delivered(w, moved);
+    if (moved == left && reuse)
+        upool_put(&px->upool, req->host, req->port, us);
+    else
+        safe_close(us);
+    return moved == left ? 0 : -1;
+}
+
+static int stream_reader_to_client(proxy_ctx_t *px, const http_request_t *req, record_t *r, int fd,
+                                   resp_writer_t *w) {
+    int told = 0;
     while (1) {
         const void *ptr;
         size_t len;
-        int done = 0;
-        int canceled = 0;
-        len = rec_wait_chunk(r, &off, &ptr, &len, &done, &canceled);
-        if (canceled) 
-            return -1;
-        if (len > 0) {
-            if (send_all(fd, ptr, len)) 
+        // a pass is only offered once we say the body goes out unchanged
+        int plain = told ? 0 : resp_plain_body(w);
+        if (plain) {
+            rec_cursor_can_take(&w->cur, plain > 0);
+            told = 1;
+        }
+        if (resp_passthrough(w) && rec_passing(r) && w->off == rec_size(r)) {
+            if (pass_to_client(px, req, r, fd, w))
                 return -1;
-            off += len;
-            continue;
         }
-        if (done) {
-            if (off >= rec_size(r)) 
-                return 0;
+        int rc = resp_next(w, r, &ptr, &len, NULL);
+        if (rc == RESP_MORE) {
+            int rfd = resp_pending_body(w) ? rec_file(r) : -1;
+            if (rfd >= 0 ? sendfile_all(fd, rfd, w->off, len) : send_all(fd, ptr, len))
+                return -1;
+            resp_consumed(w, len);
+            rec_cursor_move(r, &w->cur, w->off);
             continue;
         }
+        if (rc == RESP_DONE) 
+            return 0;
+        if (rc == RESP_ERROR) 
+            return -1;
+        if (resp_passthrough(w) && rec_teeing(r) && tap_live(r, fd, w) == 0)
+            continue;
+
+        int done = 0;
+        int canceled = 0;
+        size_t off = w->off;
+        rec_wait_chunk(r, &off, &ptr, &len, &done, &canceled);
     }
 }
 
-static int fetch_and_stream(proxy_ctx_t *px, record_t *r, const http_request_t *req, int client_fd) {
-    if (stop_flag) { 
-        rec_cancel(&px->cache, r);
-        return -1;
+static int open_upstream(proxy_ctx_t *px, const http_request_t *req, int *reused) {
+    char reqbuf[4096];
+    int qlen = http_build_upstream_get(reqbuf, sizeof reqbuf, req);
+
+    while (1) {
+        int us = *reused ? upool_get(&px->upool, req->host, req->port) : -1;
+        *reused = us >= 0;
+        if (us < 0)
+            us = net_connect_host(req->host, req->port, CONNECT_TIMEOUT_MS);
+        if (us < 0)
+            return -1;
+
+        set_timeouts(us, FIRST_BYTE_MS, IDLE_RW_MS);
+        if (send_all(us, reqbuf, (size_t)qlen) == 0)
+            return us;
+        safe_close(us);
+        if (!*reused)
+            return -1;
+        *reused = 0;
     }
+}
 
-    int us = net_connect_host(req->host, req->port, CONNECT_TIMEOUT_MS);
-    if (us < 0) {
-        rec_cancel(&px->cache, r);
-        return -1;
+static void close_upstream(proxy_ctx_t *px, const http_request_t *req, int us, const http_framer_t *f) {
+    if (http_framer_done(f) && f->keep_alive)
+        upool_put(&px->upool, req->host, req->port, us);
+    else
+        safe_close(us);
+}
+
+typedef struct {
+    proxy_ctx_t *px;
+    record_t *r;
+    const http_framer_t *f;
+} store_ctx_t;
+
+static int store_chunk(void *arg, const void *buf, size_t len) {
+    store_ctx_t *sc = (store_ctx_t *) arg;
+    if (sc->f->expect >= 0)
+        rec_declare_length(sc->r, (size_t) sc->f->expect);
+    // the head comes first; a response not worth keeping leaves the index
+    if (sc->f->bypass && !rec_size(sc->r))
+        rec_forget(&sc->px->cache, sc->r);
+    return rec_append(&sc->px->cache, sc->r, buf, len);
+}
+
+static int tap_drain(rec_tap_t *t) {
+    while (t->queued) {
+        ssize_t w = splice(t->pipe[0], NULL, t->fd, NULL, t->queued, SPLICE_F_NONBLOCK);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return errno == EAGAIN ? 0 : -1;
+        t->sent += (size_t) w;
+        t->queued -= (size_t) w;
     }
+    return 0;
+}
 
-    set_timeouts(us, FIRST_BYTE_MS, IDLE_RW_MS);
+/* Moves up to cap bytes from upstream into the pipe, tees them to every
+   tap and then reads them into dst, the only copy made. Taps are taken
+   after the bytes arrive, so a reader that caught up while the fetcher
+   waited gets them too. A tap's own pipe absorbs what its socket cannot
+   take yet; once that is full as well the tap is released to catch up
+   from the cache. Taps that attached during a round that skipped the tee
+   missed its bytes and are sent back before the fetcher blocks again. */
+static ssize_t tee_round(record_t *r, int us, int *p, char *dst, size_t cap) {
+    (void) rec_taps(r);
+    ssize_t n = splice(us, NULL, p[1], NULL, cap, SPLICE_F_MOVE);
+    if (n <= 0)
+        return n;
 
-    char reqbuf[4096];
-    int qlen = http_build_upstream_get(reqbuf, sizeof reqbuf, req);
-    if (send_all(us, reqbuf, (size_t)qlen)) {
-        safe_close(us);
+    rec_tap_t **live = rec_taps(r);
+    while (*live) {
+        rec_tap_t *t = *live;
+        int ok = tap_drain(t) == 0 && tee(p[0], t->pipe[1], (size_t) n, SPLICE_F_NONBLOCK) == n;
+        if (ok) {
+            t->queued += (size_t) n;
+            ok = tap_drain(t) == 0;
+        }
+        if (ok) {
+            live = &t->next;
+            continue;
+        }
+        *live = t->next;
+        rec_tap_release(t);
+    }
+
+    for (ssize_t got = 0; got < n;) {
+        ssize_t k = read(p[0], dst + got, (size_t) (n - got));
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0) {
+            worker_pipe_drop(p);
+            return -1;
+        }
+        got += k;
+    }
+    return n;
+}
+
+/* Pulls the response into the cache and nothing else; the initiating
+   client reads it back like a joiner, so it cannot slow the download.
+   Until the record has bytes or is settled its client sends nothing and
+   keeps the socket open, so a failure before the first byte may still be
+   answered on client_fd here. */
+static void fetch_to_cache(proxy_ctx_t *px, record_t *r, const http_request_t *req, int client_fd) {
+    int reused = 1;
+    int us = stop_flag ? -1 : open_upstream(px, req, &reused);
+    if (us < 0) {
         rec_cancel(&px->cache, r);
-        return -1;
+        return;
     }
 
     char buf[64*1024];
-    int initiator_alive = (client_fd >= 0);
     size_t rx = 0; // ← считаем полученные байты
+    int *tp = NULL;
+    int no_pass = 0;
+    http_framer_t f;
+    http_framer_init(&f);
+    store_ctx_t sc = { px, r, &f };
 
     while (1) {
         if (stop_flag) {
             safe_close(us);
             rec_cancel(&px->cache, r);
-            return -1;
+            return;
+        }
+
+        // plain body goes straight into the record, the rest through buf
+        char *dst = buf;
+        size_t cap = http_framer_direct(&f);
+        // with nobody else reading, the client takes the rest straight from upstream
+        if (cap && f.bypass && f.expect >= 0 && !no_pass) {
+            int rc = rec_pass(&px->cache, r, us, cap, f.keep_alive);
+            if (rc == 0) {
+                rec_finish(&px->cache, r);
+                return;
+            }
+            no_pass = rc < 0;
+        }
+        if (rec_window_wait(&px->cache, r)) {
+            safe_close(us);
+            rec_cancel(&px->cache, r);
+            return;
+        }
+        if (cap)
+            dst = rec_reserve(&px->cache, r, &cap);
+        else
+            cap = sizeof buf;
+        if (!dst) {
+            safe_close(us);
+            rec_cancel(&px->cache, r);
+            return;
+        }
+
+        // a sized body arrives as is, so readers at its live end can be teed
+        if (dst != buf && f.expect >= 0 && !f.bypass && !tp && (tp = worker_pipe()))
+            rec_tee_open(r);
+
+        // readers below their wake threshold get what is there before we block
+        ssize_t n;
+        if (tp && rec_tapped(r)) {
+            rec_flush(r);
+            n = tee_round(r, us, tp, dst, cap < BLOCK_SZ ? cap : BLOCK_SZ);
+        } else {
+            n = recv(us, dst, cap, MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                rec_flush(r);
+                n = recv(us, dst, cap, 0);
+            }
+        }
+        if (n < 0 && errno == EINTR) 
+            continue;
+
+        if (rx == 0 && reused && (n == 0 || (n < 0 && (errno == ECONNRESET || errno == EPIPE)))) {
+            safe_close(us);
+            reused = 0;
+            us = open_upstream(px, req, &reused);
+            if (us < 0) {
+                rec_cancel(&px->cache, r);
+                return;
+            }
+            continue;
         }
 
-        ssize_t n = recv(us, buf, sizeof buf, 0);
         if (n == 0) 
             break;
         if (n < 0) {
-            if (errno == EINTR) 
-                continue;
-
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 if (rx == 0) {
                     const char *resp = "HTTP/1.0 Gateway Timeout\r\nConnection: close\r\n\r\n";
                     (void)send_all(client_fd, resp, strlen(resp));
                     safe_close(us);
                     rec_cancel(&px->cache, r);
-                    return -1;
+                    return;
                 }
                 break;
             }
 
-            if ((errno == ECONNRESET || errno == EPIPE)) {
-                if (rx > 0)
-                    break;
-
-                const char *resp = "HTTP/1.0 Bad Gateway\r\nConnection: close\r\n\r\n";
-                (void)send_all(client_fd, resp, strlen(resp));
-                safe_close(us);
-                rec_cancel(&px->cache, r);
-                return -1;
-            }
-
             if (rx == 0) {
                 const char *resp = "HTTP/1.0 Bad Gateway\r\nConnection: close\r\n\r\n";
                 (void)send_all(client_fd, resp, strlen(resp));
                 safe_close(us);
                 rec_cancel(&px->cache, r);
-                return -1;
+                return;
             }
             break;
         }
@@ -160,108 +436,754 @@ static int fetch_and_stream(proxy_ctx_t *px, record_t *r, const http_request_t *
         if (rx == (size_t)n)
             set_timeouts(us, IDLE_RW_MS, IDLE_RW_MS);
 
-        if (initiator_alive) {
-            if (send_all(client_fd, buf, (size_t)n) != 0)
-                initiator_alive = 0; 
-        }
-
-        if (rec_append(&px->cache, r, buf, (size_t)n)) {
+        int fr;
+        if (dst == buf)
+            fr = http_framer_feed(&f, buf, (size_t)n, store_chunk, &sc);
+        else
+            fr = rec_commit(r, (size_t)n) ? -1 : http_framer_direct_done(&f, (size_t)n);
+        if (fr < 0) {
             safe_close(us);
             rec_cancel(&px->cache, r);
-            return -1;
+            return;
         }
+        if (fr == 1)
+            break;
     }
 
-    safe_close(us);
+    if (!http_framer_done(&f) && http_framer_eof(&f, store_chunk, &sc)) {
+        safe_close(us);
+        rec_cancel(&px->cache, r);
+        return;
+    }
+    close_upstream(px, req, us, &f);
     rec_finish(&px->cache, r);
-    return 0;
 }
 
-static void handle_client(void *arg) {
-    client_job_t *cj = (client_job_t *) arg;
-    proxy_ctx_t *px = cj->px;
-    int fd = cj->client_fd;
-    set_timeouts(fd, IDLE_RW_MS, IDLE_RW_MS);
-
+/* The request's slices point into the client's buffer, so the job keeps
+   its own copy of what the fetch needs. */
+typedef struct {
+    proxy_ctx_t *px;
+    record_t *r;
+    int client_fd;
     http_request_t req;
-    if (http_parse_client_request(fd, &req) != 0) {
-        const char *resp = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
-        send_all(fd, resp, strlen(resp));
-        close_client_job(cj);
-        return;
+    char path[];
+} fetch_job_t;
+
+static void fetch_job(void *arg) {
+    fetch_job_t *j = (fetch_job_t *) arg;
+    fetch_to_cache(j->px, j->r, &j->req, j->client_fd);
+    cache_release(j->r);
+    free(j);
+}
+
+static int fetch_and_stream(shard_t *sh, record_t *r, const http_request_t *req, int client_fd, resp_writer_t *w) {
+    proxy_ctx_t *px = sh->px;
+    fetch_job_t *j = malloc(sizeof *j + req->path.len);
+    if (!j) {
+        rec_cancel(&px->cache, r);
+        return -1;
+    }
+    j->px = px;
+    j->r = r;
+    j->client_fd = client_fd;
+    memset(&j->req, 0, sizeof j->req);
+    memcpy(j->req.host, req->host, sizeof j->req.host);
+    j->req.port = req->port;
+    memcpy(j->path, req->path.p, req->path.len);
+    j->req.path = (http_slice_t) { j->path, req->path.len };
+
+    cache_retain(r);
+    tp_submit(&sh->fetch_tp, fetch_job, j);
+    return stream_reader_to_client(px, req, r, client_fd, w);
+}
+
+enum { UD_RECV = 1, UD_SEND, UD_CANCEL_UP, UD_CANCEL_CL, UD_ACCEPT };
+
+typedef struct {
+    int fd;
+    resp_writer_t *w;
+    size_t sent;
+    int pending;
+    int alive;
+    int last;
+    uint64_t deadline;
+    char scratch[URING_CHAIN_MAX][32];
+} uring_sink_t;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static void ring_free(void *p) {
+    uring_destroy((uring_t *) p);
+    free(p);
+}
+
+static void ring_key_init(void) {
+    pthread_key_create(&ring_key, ring_free);
+}
+
+static uring_t *worker_ring(void) {
+    pthread_once(&ring_once, ring_key_init);
+    uring_t *u = pthread_getspecific(ring_key);
+    if (u)
+        return u;
+
+    u = calloc(1, sizeof *u);
+    if (!u)
+        return NULL;
+    if (uring_init(u, URING_ENTRIES) || uring_setup_bufs(u, URING_NBUFS, URING_BUF_SZ)) {
+        log_err("io_uring worker ring: %s, falling back to plain sockets", strerror(errno));
+        ring_free(u);
+        return NULL;
+    }
+    pthread_setspecific(ring_key, u);
+    return u;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/* Called with no sends in flight, so the record is no longer needed
+   below the writer's offset. */
+static int sink_fill(uring_t *u, uring_sink_t *s, record_t *r) {
+    struct io_uring_sqe *prev = NULL;
+    int n = 0;
+    rec_cursor_move(r, &s->w->cur, s->w->off);
+    while (n < URING_CHAIN_MAX) {
+        const void *ptr;
+        size_t len;
+        s->last = resp_next(s->w, r, &ptr, &len, NULL);
+        if (s->last != RESP_MORE)
+            break;
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        if (!sqe)
+            break;
+        if (resp_pending_meta(s->w)) {
+            memcpy(s->scratch[n], ptr, len);
+            ptr = s->scratch[n];
+        }
+        if (prev)
+            prev->flags |= IOSQE_IO_LINK;
+        uring_prep_send(sqe, s->fd, ptr, len, (unsigned long long) len << 8 | UD_SEND);
+        resp_consumed(s->w, len);
+        prev = sqe;
+        n++;
     }
+    s->pending += n;
+    if (n)
+        s->deadline = now_ms() + IDLE_RW_MS;
+    return n;
+}
+
+static void sink_complete(uring_sink_t *s, int res, unsigned long long ud) {
+    s->pending--;
+    if (res > 0)
+        s->sent += (size_t) res;
+    if (res < 0 || (unsigned long long) res != ud >> 8)
+        s->alive = 0;
+}
+
+static int uring_cancel(uring_t *u, int fd, unsigned long long ud) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (!sqe)
+        return 0;
+    uring_prep_cancel_fd(sqe, fd, ud);
+    return 1;
+}
+
+static int stream_reader_uring(uring_t *u, record_t *r, int fd, resp_writer_t *w) {
+    uring_sink_t s = { .fd = fd, .w = w, .alive = 1, .last = RESP_WAIT };
+    int cancels = 0;
+    int rc = 0;
+
+    while (s.alive || s.pending || cancels) {
+        if (s.alive && !s.pending && !sink_fill(u, &s, r)) {
+            if (s.last == RESP_DONE)
+                break;
+            if (s.last == RESP_ERROR) {
+                rc = -1;
+                break;
+            }
+            if (s.last == RESP_WAIT) {
+                const void *ptr;
+                size_t len;
+                int done = 0;
+                int canceled = 0;
+                size_t o = w->off;
+                rec_wait_chunk(r, &o, &ptr, &len, &done, &canceled);
+                continue;
+            }
+        }
+
+        if (uring_submit_wait(u, 1, SWEEP_INTERVAL_MS) && errno != ETIME && errno != EINTR) {
+            rc = -1;
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(u))) {
+            if ((cqe->user_data & 0xff) == UD_SEND)
+                sink_complete(&s, cqe->res, cqe->user_data);
+            else if (cqe->user_data == UD_CANCEL_CL)
+                cancels--;
+            uring_cqe_seen(u);
+        }
+
+        if (s.alive && s.pending && now_ms() >= s.deadline) {
+            cancels += uring_cancel(u, fd, UD_CANCEL_CL);
+            s.alive = 0;
+        }
+    }
+    return (rc || !s.alive) ? -1 : 0;
+}
 
-    char key[4096];
-    snprintf(
-        key,
-        sizeof key,
-        "http://%s:%d%s",
-        req.host,
-        req.port,
-        req.path[0] ? req.path : "/"
-    );
+static int fetch_and_stream_uring(proxy_ctx_t *px, uring_t *u, record_t *r, const http_request_t *req, int client_fd,
+                                  resp_writer_t *w) {
+    int reused = 1;
+    int us = stop_flag ? -1 : open_upstream(px, req, &reused);
+    if (us < 0) {
+        rec_cancel(&px->cache, r);
+        return -1;
+    }
+
+    uring_sink_t s = { .fd = client_fd, .w = w, .alive = (client_fd >= 0), .last = RESP_WAIT };
+    int recv_pending = 0;
+    int recv_direct = 0;
+    int up_cancel = 0;
+    int cl_cancel = 0;
+    int up_done = 0;
+    int timed_out = 0;
+    int no_pass = 0;
+    const char *resp = NULL;
+    size_t rx = 0;
+    uint64_t up_deadline = now_ms() + FIRST_BYTE_MS;
+    http_framer_t f;
+    http_framer_init(&f);
+    store_ctx_t sc = { px, r, &f };
+
+    while (1) {
+        if (stop_flag && !up_done) {
+            up_done = -1;
+            rec_cancel(&px->cache, r);
+        }
+
+        // a client that is gone holds nothing back
+        if (!s.alive)
+            rec_cursor_detach(r, &w->cur);
+        int win = 0;
+        if (!up_done && !recv_pending && !up_cancel && (win = rec_window(&px->cache, r, NULL)) < 0) {
+            up_done = -1;
+            rec_cancel(&px->cache, r);
+        }
+        // upstream is not what keeps us waiting while paused
+        if (win > 0)
+            up_deadline = now_ms() + IDLE_RW_MS;
+        int hold = 0;
+        if (!up_done && !recv_pending && !up_cancel && !win) {
+            size_t cap = http_framer_direct(&f);
+            // once the client has what the record holds and nobody joined, it takes the rest from upstream
+            if (cap && f.bypass && f.expect >= 0 && !no_pass) {
+                no_pass = !s.alive || resp_plain_body(w) < 0;
+                hold = !no_pass && (s.pending || cl_cancel || w->off != rec_size(r) || !resp_passthrough(w));
+                if (!no_pass && !hold) {
+                    rec_cursor_can_take(&w->cur, 1);
+                    if (rec_pass(&px->cache, r, us, cap, f.keep_alive) == 0) {
+                        rec_finish(&px->cache, r);
+                        if (pass_to_client(px, req, r, client_fd, w))
+                            return -1;
+                        return stream_reader_uring(u, r, client_fd, w);
+                    }
+                    no_pass = 1;
+                }
+            }
+        }
+        if (!up_done && !recv_pending && !up_cancel && !win && !hold) {
+            // plain body is received into the record, which outlives the recv
+            size_t cap = http_framer_direct(&f);
+            char *dst = cap ? rec_reserve(&px->cache, r, &cap) : NULL;
+            struct io_uring_sqe *sqe = cap && !dst ? NULL : uring_sqe(u);
+            if (cap && !dst) {
+                up_done = -1;
+                rec_cancel(&px->cache, r);
+            } else if (sqe) {
+                if (dst)
+                    uring_prep_recv(sqe, us, dst, cap < INT_MAX ? cap : INT_MAX, UD_RECV);
+                else
+                    uring_prep_recv_select(sqe, us, u->bgid, UD_RECV);
+                recv_pending = 1;
+                recv_direct = dst != NULL;
+            }
+        }
+        if (s.alive && !s.pending)
+            sink_fill(u, &s, r);
+        // with our own sends done, the reader holding the window is a joiner
+        if (win > 0 && !s.pending) {
+            if (rec_window_wait(&px->cache, r) == 0)
+                up_deadline = now_ms() + IDLE_RW_MS;
+            continue;
+        }
+        if (!up_done)
+            rec_flush(r);
+        if (up_done && !recv_pending && !up_cancel && !s.pending && !cl_cancel &&
+            (!s.alive || s.last == RESP_DONE || s.last == RESP_ERROR))
+            break;
 
+        if (uring_submit_wait(u, 1, SWEEP_INTERVAL_MS) && errno != ETIME && errno != EINTR) {
+            log_err("io_uring_enter: %s", strerror(errno));
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(u))) {
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            unsigned long long ud = cqe->user_data;
+            uring_cqe_seen(u);
+
+            if ((ud & 0xff) == UD_SEND) {
+                sink_complete(&s, res, ud);
+                continue;
+            }
+            if (ud == UD_CANCEL_UP) {
+                up_cancel = 0;
+                continue;
+            }
+            if (ud == UD_CANCEL_CL) {
+                cl_cancel = 0;
+                continue;
+            }
+            if (ud != UD_RECV)
+                continue;
+
+            recv_pending = 0;
+            if (res > 0 && (recv_direct || (flags & IORING_CQE_F_BUFFER))) {
+                int fr;
+                if (recv_direct) {
+                    fr = up_done || rec_commit(r, (size_t) res) ? -1 : http_framer_direct_done(&f, (size_t) res);
+                } else {
+                    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                    fr = up_done ? -1 : http_framer_feed(&f, uring_buf(u, bid), (size_t) res, store_chunk, &sc);
+                    uring_buf_recycle(u, bid);
+                }
+                if (fr < 0) {
+                    if (!up_done)
+                        rec_cancel(&px->cache, r);
+                    up_done = -1;
+                    continue;
+                }
+                rx += (size_t) res;
+                timed_out = 0;
+                up_deadline = now_ms() + IDLE_RW_MS;
+                if (fr == 1) {
+                    up_done = 1;
+                    rec_finish(&px->cache, r);
+                }
+                continue;
+            }
+            if (up_done || res == -ENOBUFS)
+                continue;
+            if (rx == 0 && reused && (res == 0 || res == -ECONNRESET || res == -EPIPE)) {
+                safe_close(us);
+                reused = 0;
+                us = open_upstream(px, req, &reused);
+                up_deadline = now_ms() + FIRST_BYTE_MS;
+                if (us < 0) {
+                    up_done = -1;
+                    rec_cancel(&px->cache, r);
+                }
+                continue;
+            }
+            if (res == 0 || rx > 0) {
+                if (http_framer_eof(&f, store_chunk, &sc)) {
+                    up_done = -1;
+                    rec_cancel(&px->cache, r);
+                } else {
+                    up_done = 1;
+                    rec_finish(&px->cache, r);
+                }
+                continue;
+            }
+            up_done = -1;
+            resp = timed_out ? "HTTP/1.0 Gateway Timeout\r\nConnection: close\r\n\r\n"
+                             : "HTTP/1.0 Bad Gateway\r\nConnection: close\r\n\r\n";
+            rec_cancel(&px->cache, r);
+        }
+
+        uint64_t now = now_ms();
+        if (recv_pending && !up_cancel && now >= up_deadline) {
+            timed_out = 1;
+            up_cancel = uring_cancel(u, us, UD_CANCEL_UP);
+        }
+        if (s.alive && s.pending && !cl_cancel && now >= s.deadline) {
+            cl_cancel = uring_cancel(u, client_fd, UD_CANCEL_CL);
+            s.alive = 0;
+        }
+    }
+
+    if (up_done == 1)
+        close_upstream(px, req, us, &f);
+    else
+        safe_close(us);
+    if (resp && client_fd >= 0 && s.sent == 0)
+        (void) send_all(client_fd, resp, strlen(resp));
+    return up_done == 1 && s.alive && s.last == RESP_DONE ? 0 : -1;
+}
+
+static int serve_request(shard_t *sh, const http_request_t *req, int fd) {
+    proxy_ctx_t *px = sh->px;
+    cache_key_t key = { req->origin, req->origin_len, req->path.p, req->path.len, req->key_hash };
     cache_acquire_t acq = (cache_acquire_t) {0};
-    cache_acquire(&px->cache, key, &acq);
+    if (cache_acquire(&px->cache, &key, &acq))
+        return 0;
 
+    resp_writer_t *w = malloc(sizeof *w);
+    if (!w) {
+        // joiners counts this reader, so it must still show up as seen and gone
+        rec_cursor_t gone;
+        rec_cursor_attach(acq.rec, &gone);
+        rec_cursor_detach(acq.rec, &gone);
+        if (acq.is_fetcher)
+            rec_cancel(&px->cache, acq.rec);
+        cache_release(acq.rec);
+        return 0;
+    }
+    resp_init(w, req->keep_alive, req->http11);
+    rec_cursor_attach(acq.rec, &w->cur);
+
+    int rc;
+    uring_t *u = px->mode == PROXY_MODE_URING ? worker_ring() : NULL;
     if (acq.is_fetcher) {
-        log_info("MISS+FETCH %s", key);
-        (void) fetch_and_stream(px, acq.rec, &req, fd);
+        log_info("MISS+FETCH %s", rec_key(acq.rec));
+        if (u)
+            rc = fetch_and_stream_uring(px, u, acq.rec, req, fd, w);
+        else
+            rc = fetch_and_stream(sh, acq.rec, req, fd, w);
     } else {
         if (rec_is_completed(acq.rec)) {
-            log_info("HIT %s", key);
-            rec_touch_lru(&px->cache, acq.rec);
+            log_info("HIT %s", rec_key(acq.rec));
+            rec_touch(&px->cache, acq.rec);
         } else {
-            log_info("JOIN %s", key);
+            log_info("JOIN %s", rec_key(acq.rec));
         }
-        (void) stream_reader_to_client(acq.rec, fd);
+        if (u)
+            rc = stream_reader_uring(u, acq.rec, fd, w);
+        else
+            rc = stream_reader_to_client(px, req, acq.rec, fd, w);
     }
 
+    int keep = rc == 0 && w->keep_alive;
+    rec_cursor_detach(acq.rec, &w->cur);
+    free(w);
     cache_release(acq.rec);
+    return keep;
+}
+
+static void handle_client(void *arg) {
+    client_job_t *cj = (client_job_t *) arg;
+    int fd = cj->client_fd;
+    set_timeouts(fd, IDLE_RW_MS, IDLE_RW_MS);
+
+    http_reqbuf_t rb;
+    http_reqbuf_init(&rb);
+    for (int n = 0; !stop_flag; n++) {
+        if (n > 0)
+            set_timeouts(fd, KEEPALIVE_IDLE_MS, IDLE_RW_MS);
+
+        http_request_t req;
+        int rc = http_read_request(fd, &rb, &req);
+        if (rc != 0) {
+            if (n == 0 || rc != -1) {
+                const char *resp = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
+                send_all(fd, resp, strlen(resp));
+            }
+            break;
+        }
+        if (n > 0)
+            set_timeouts(fd, IDLE_RW_MS, IDLE_RW_MS);
+
+        if (!serve_request(cj->sh, &req, fd))
+            break;
+    }
+
     close_client_job(cj);
 }
 
-int proxy_init(proxy_ctx_t *px, int port, int workers) {
-    px->listen_fd = net_listen(port);
-    if (px->listen_fd < 0) 
-        return -1;
-    if (cache_init(&px->cache, N_BUCKETS, SOFT_LIMIT_BYTES)) 
-        return -1;
-    px->workers = workers;
-    if (tp_init(&px->tp, px->workers, QUEUE_CAP)) 
+static void dispatch_client(shard_t *sh, int cfd, const struct sockaddr_in *sa) {
+    atomic_fetch_add(&sh->accepted, 1);
+
+    client_job_t *cj = calloc(1, sizeof *cj);
+    if (!cj) {
+        safe_close(cfd);
+        return;
+    }
+    cj->sh = sh;
+    cj->client_fd = cfd;
+    if (sa)
+        cj->addr = *sa;
+    tp_submit(&sh->tp, handle_client, cj);
+}
+
+static int accept_loop_uring(shard_t *sh) {
+    uring_t u;
+    if (uring_init(&u, URING_ENTRIES)) {
+        log_err("io_uring accept ring: %s, falling back to accept()", strerror(errno));
         return -1;
+    }
+
+    int armed = 0;
+    while (!stop_flag) {
+        if (!armed) {
+            struct io_uring_sqe *sqe = uring_sqe(&u);
+            if (sqe) {
+                uring_prep_accept_multishot(sqe, sh->listen_fd, UD_ACCEPT);
+                armed = 1;
+            }
+        }
+
+        if (uring_submit_wait(&u, 1, SWEEP_INTERVAL_MS) && errno != ETIME && errno != EINTR) {
+            log_err("io_uring_enter: %s", strerror(errno));
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&u))) {
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&u);
+
+            if (!(flags & IORING_CQE_F_MORE))
+                armed = 0;
+            if (res >= 0) {
+                dispatch_client(sh, res, NULL);
+                continue;
+            }
+            if (res != -EINTR && res != -ECANCELED && !stop_flag)
+                log_err("accept: %s", strerror(-res));
+        }
+    }
+
+    uring_destroy(&u);
     return 0;
 }
 
-void proxy_run_accept_loop(proxy_ctx_t *px) {
-    log_info("listening on port %d, workers=%d, buckets=%d", PROXY_PORT, px->workers, (int) N_BUCKETS);
-    while (1) {
+static void *accept_main(void *arg) {
+    shard_t *sh = (shard_t *) arg;
+    if (sh->px->mode == PROXY_MODE_URING && accept_loop_uring(sh) == 0)
+        return NULL;
+
+    while (!stop_flag) {
         struct sockaddr_in sa;
         socklen_t sl = sizeof sa;
-        int cfd = accept(px->listen_fd, (struct sockaddr *) &sa, &sl);
+        int cfd = accept(sh->listen_fd, (struct sockaddr *) &sa, &sl);
         if (cfd < 0) {
-            if (errno == EINTR) 
+            if (errno == EINTR || errno == ECONNABORTED) 
                 continue;
-            if (stop_flag && errno == EBADF) 
+            if (stop_flag) 
                 break;
             log_err("accept: %s", strerror(errno));
             break;
         }
-        client_job_t *cj = calloc(1, sizeof *cj);
-        if (!cj) {
-            safe_close(cfd);
-            continue;
+        dispatch_client(sh, cfd, &sa);
+    }
+    return NULL;
+}
+
+static const char *mode_name(int mode) {
+    switch (mode) {
+    case PROXY_MODE_EPOLL:
+        return "epoll";
+    case PROXY_MODE_URING:
+        return "uring";
+    default:
+        return "threads";
+    }
+}
+
+static int shard_init(proxy_ctx_t *px, shard_t *sh, int id, int port) {
+    sh->px = px;
+    sh->id = id;
+    sh->cpu = id % (int) sysconf(_SC_NPROCESSORS_ONLN);
+    atomic_init(&sh->accepted, 0);
+    sh->listen_fd = net_listen(port);
+    if (sh->listen_fd < 0) 
+        return -1;
+
+    if (tp_init(&sh->tp, px->workers, QUEUE_CAP)) 
+        return -1;
+    sh->has_tp = 1;
+    if (tp_set_affinity(&sh->tp, sh->cpu))
+        log_err("shard %d: cannot pin workers to cpu %d", id, sh->cpu);
+
+    // fetches run on their own workers so a slow client cannot hold one
+    if (px->mode == PROXY_MODE_THREADS) {
+        if (tp_init(&sh->fetch_tp, px->workers, QUEUE_CAP))
+            return -1;
+        sh->has_fetch_tp = 1;
+        if (tp_set_affinity(&sh->fetch_tp, sh->cpu))
+            log_err("shard %d: cannot pin fetch workers to cpu %d", id, sh->cpu);
+    }
+
+    if (px->mode == PROXY_MODE_EPOLL) {
+        if (reactor_init(&sh->re, px, sh)) 
+            return -1;
+        if (reactor_start(&sh->re)) {
+            reactor_destroy(&sh->re);
+            return -1;
+        }
+        sh->has_reactor = 1;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(sh->cpu, &set);
+        pthread_setaffinity_np(sh->re.th, sizeof set, &set);
+        return 0;
+    }
+
+    if (pthread_create(&sh->accept_th, NULL, accept_main, sh)) 
+        return -1;
+    sh->has_accept_th = 1;
+    return 0;
+}
+
+static int proxy_start(proxy_ctx_t *px, int port, int workers, int mode) {
+    if (cache_init(&px->cache, INDEX_SHARDS, SOFT_LIMIT_BYTES)) 
+        return -1;
+    if (upool_init(&px->upool, UPOOL_BUCKETS, UPOOL_PER_HOST, UPOOL_IDLE_MS))
+        return -1;
+    px->workers = workers;
+    px->mode = mode;
+
+    int n = SHARDS > 0 ? SHARDS : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) 
+        n = 1;
+    px->shards = calloc((size_t) n, sizeof *px->shards);
+    if (!px->shards) 
+        return -1;
+    for (int i = 0; i < n; i++)
+        px->shards[i].listen_fd = -1;
+
+    int rc = 0;
+    for (int i = 0; i < n && rc == 0; i++) {
+        px->nshards++;
+        rc = shard_init(px, &px->shards[i], i, port);
+    }
+    return rc;
+}
+
+int proxy_init(proxy_ctx_t *px, int port, int workers, int mode) {
+    memset(px, 0, sizeof *px);
+
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    int rc = proxy_start(px, port, workers, mode);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return rc;
+}
+
+static void report_stats(proxy_ctx_t *px, double secs) {
+    for (int i = 0; i < px->nshards; i++) {
+        shard_t *sh = &px->shards[i];
+        unsigned long acc = atomic_load(&sh->accepted);
+        unsigned long delta = acc - sh->last_accepted;
+        sh->last_accepted = acc;
+        log_info("shard %d cpu %d: accepted=%lu rate=%.1f/s queue=%d conns=%d",
+                 sh->id, sh->cpu, acc, secs > 0 ? delta / secs : 0.0,
+                 sh->has_tp ? jq_depth(&sh->tp.q) : 0,
+                 sh->has_reactor ? atomic_load(&sh->re.nconns) : 0);
+    }
+    log_info("cache: hits=%zu misses=%zu stores=%zu evicts=%zu stalls=%zu bytes=%zu inflight=%zu",
+             __atomic_load_n(&px->cache.hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.misses, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.stores, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.evicts, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.stalls, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.bytes_completed, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.bytes_inflight, __ATOMIC_RELAXED));
+    size_t hits = __atomic_load_n(&px->cache.hits, __ATOMIC_RELAXED);
+    size_t misses = __atomic_load_n(&px->cache.misses, __ATOMIC_RELAXED);
+    size_t hit_bytes = __atomic_load_n(&px->cache.hit_bytes, __ATOMIC_RELAXED);
+    size_t fetch_bytes = __atomic_load_n(&px->cache.fetch_bytes, __ATOMIC_RELAXED);
+    log_info("hit ratio: objects=%.3f bytes=%.3f",
+             hits + misses ? (double) hits / (double) (hits + misses) : 0.0,
+             hit_bytes + fetch_bytes ? (double) hit_bytes / (double) (hit_bytes + fetch_bytes) : 0.0);
+    log_info("admission: admits=%zu rejects=%zu window=%zu",
+             __atomic_load_n(&px->cache.admits, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.rejects, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.window_bytes, __ATOMIC_RELAXED));
+    log_info("compaction: records=%zu saved=%zd memfd=%zu",
+             __atomic_load_n(&px->cache.compacted, __ATOMIC_RELAXED),
+             (ssize_t) __atomic_load_n(&px->cache.compact_saved, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.compact_files, __ATOMIC_RELAXED));
+    log_info("block pool: mapped=%zu released=%zu",
+             __atomic_load_n(&px->cache.pool.mapped, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->cache.pool.released, __ATOMIC_RELAXED));
+    log_info("upstream pool: reused=%zu connects=%zu parked=%zu reaped=%zu idle=%zu",
+             __atomic_load_n(&px->upool.reused, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->upool.missed, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->upool.parked, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->upool.reaped, __ATOMIC_RELAXED),
+             __atomic_load_n(&px->upool.idle, __ATOMIC_RELAXED));
+}
+
+void proxy_run_accept_loop(proxy_ctx_t *px) {
+    log_info("listening on port %d, mode=%s, shards=%d, workers/shard=%d, index shards=%d", PROXY_PORT,
+             mode_name(px->mode), px->nshards, px->workers, (int) INDEX_SHARDS);
+    log_info("header scanner: %s", hscan_impl_name());
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    uint64_t last = now_ms();
+    while (!stop_flag) {
+        struct timespec ts = { SWEEP_INTERVAL_MS / 1000, (SWEEP_INTERVAL_MS % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+        upool_reap(&px->upool);
+        uint64_t now = now_ms();
+        if (now - last >= STATS_INTERVAL_MS) {
+            report_stats(px, (double) (now - last) / 1000.0);
+            last = now;
         }
-        cj->px = px;
-        cj->client_fd = cfd;
-        cj->addr = sa;
-        tp_submit(&px->tp, handle_client, cj);
     }
+
+    for (int i = 0; i < px->nshards; i++)
+        if (px->shards[i].has_accept_th)
+            pthread_join(px->shards[i].accept_th, NULL);
+    report_stats(px, (double) (now_ms() - last) / 1000.0);
+}
+
+void proxy_wakeup(proxy_ctx_t *px) {
+    for (int i = 0; i < px->nshards; i++)
+        if (px->shards[i].listen_fd >= 0)
+            shutdown(px->shards[i].listen_fd, SHUT_RDWR);
 }
 
 void proxy_shutdown(proxy_ctx_t *px) {
-    tp_poison_and_join(&px->tp);
-    tp_destroy(&px->tp);
+    for (int i = 0; i < px->nshards; i++)
+        if (px->shards[i].has_tp)
+            tp_poison_and_join(&px->shards[i].tp);
+    for (int i = 0; i < px->nshards; i++)
+        if (px->shards[i].has_fetch_tp)
+            tp_poison_and_join(&px->shards[i].fetch_tp);
+    for (int i = 0; i < px->nshards; i++) {
+        shard_t *sh = &px->shards[i];
+        if (sh->has_reactor) {
+            reactor_stop_and_join(&sh->re);
+            reactor_destroy(&sh->re);
+        }
+        if (sh->has_tp)
+            tp_destroy(&sh->tp);
+        if (sh->has_fetch_tp)
+            tp_destroy(&sh->fetch_tp);
+        safe_close(sh->listen_fd);
+    }
+    free(px->shards);
+    upool_destroy(&px->upool);
     cache_destroy(&px->cache);
-    safe_close(px->listen_fd);
 }
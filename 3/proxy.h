@@ -1,14 +1,40 @@
 #pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "cache.h"
+#include "upool.h"
 #include "threadpool.h"
+#include "reactor.h"
+
+enum { PROXY_MODE_THREADS, PROXY_MODE_EPOLL, PROXY_MODE_URING };
 
-typedef struct {
+typedef struct shard {
+    struct proxy_ctx *px;
+    int id;
+    int cpu;
     int listen_fd;
-    cache_t cache;
     threadpool_t tp;
+    threadpool_t fetch_tp;
+    reactor_t re;
+    pthread_t accept_th;
+    int has_tp, has_fetch_tp, has_reactor, has_accept_th;
+
+    atomic_ulong accepted;
+    unsigned long last_accepted;
+} shard_t;
+
+typedef struct proxy_ctx {
+    cache_t cache;
+    upool_t upool;
     int workers;
+    int mode;
+
+    shard_t *shards;
+    int nshards;
 } proxy_ctx_t;
 
-int proxy_init(proxy_ctx_t *px, int port, int workers);
+int proxy_init(proxy_ctx_t *px, int port, int workers, int mode);
 void proxy_run_accept_loop(proxy_ctx_t *px);
+void proxy_wakeup(proxy_ctx_t *px);
 void proxy_shutdown(proxy_ctx_t *px);
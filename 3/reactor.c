@@ -0,0 +1,940 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include "reactor.h"
+#include "proxy.h"
+#include "config.h"
+#include "net.h"
+#include "http.h"
+#include "logger.h"
+#include "resp.h"
+
+extern volatile sig_atomic_t stop_flag;
+
+static const char BAD_REQUEST[] = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
+static const char BAD_GATEWAY[] = "HTTP/1.0 Bad Gateway\r\nConnection: close\r\n\r\n";
+static const char GATEWAY_TIMEOUT[] = "HTTP/1.0 Gateway Timeout\r\nConnection: close\r\n\r\n";
+
+enum { SRC_CLIENT, SRC_UPSTREAM };
+
+enum { CL_READ_REQ, CL_STREAM, CL_REPLY, CL_DONE };
+enum { UP_NONE, UP_RESOLVING, UP_CONNECTING, UP_SENDING, UP_RECV, UP_PASS, UP_DONE };
+
+typedef struct conn conn_t;
+
+// an upstream exchange in progress; freed as soon as it ends
+typedef struct {
+    http_framer_t fr;
+    char req[4096];
+    int no_pass, held;
+    int pipe[2];
+    size_t left, queued;
+    int reuse;
+} up_buf_t;
+
+typedef struct {
+    conn_t *c;
+    int which;
+} ev_src_t;
+
+struct conn {
+    reactor_t *re;
+    int cfd, ufd;
+    int cl, up;
+    int adopted, dead;
+
+    ev_src_t cev, uev;
+    unsigned up_events;
+
+    // the buffers are only held while a request is in progress
+    http_reqbuf_t *in;
+    http_request_t req;
+
+    record_t *rec;
+    rec_waiter_t w;
+    resp_writer_t *rw;
+    record_t *up_rec;
+    rec_waiter_t uw;
+    up_buf_t *ub;
+    int up_reused;
+
+    const char *reply;
+    size_t reply_len, reply_off;
+
+    size_t upreq_len, upreq_off;
+    size_t rx;
+
+    struct addrinfo *ai, *ai_next;
+    atomic_int resolved; // 0 while the lookup runs, 1 once ai is set, 2 once it let go of c
+    int resolve_rc, resolve_out;
+
+    uint64_t cl_deadline, up_deadline;
+
+    conn_t *prev, *next;
+    conn_t *inbox_next;
+    int in_inbox;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void reactor_post(reactor_t *re, conn_t *c) {
+    int kick = 0;
+    pthread_mutex_lock(&re->inbox_m);
+    if (!c->in_inbox) {
+        c->in_inbox = 1;
+        kick = (re->inbox == NULL);
+        c->inbox_next = re->inbox;
+        re->inbox = c;
+    }
+    pthread_mutex_unlock(&re->inbox_m);
+
+    if (kick) {
+        uint64_t one = 1;
+        ssize_t w = write(re->evfd, &one, sizeof one);
+        (void) w;
+    }
+}
+
+static void inbox_unlink(reactor_t *re, conn_t *c) {
+    pthread_mutex_lock(&re->inbox_m);
+    if (c->in_inbox) {
+        conn_t **pp = &re->inbox;
+        while (*pp && *pp != c)
+            pp = &(*pp)->inbox_next;
+        if (*pp)
+            *pp = c->inbox_next;
+        c->inbox_next = NULL;
+        c->in_inbox = 0;
+    }
+    pthread_mutex_unlock(&re->inbox_m);
+}
+
+static void on_record_update(rec_waiter_t *w) {
+    conn_t *c = (conn_t *) ((char *) w - offsetof(conn_t, w));
+    reactor_post(c->re, c);
+}
+
+static void on_window_open(rec_waiter_t *w) {
+    conn_t *c = (conn_t *) ((char *) w - offsetof(conn_t, uw));
+    reactor_post(c->re, c);
+}
+
+static void client_release(conn_t *c) {
+    if (c->rec) {
+        rec_waiter_cancel(c->rec, &c->w);
+        rec_cursor_detach(c->rec, &c->rw->cur);
+        cache_release(c->rec);
+        c->rec = NULL;
+    }
+    free(c->rw);
+    c->rw = NULL;
+}
+
+static void client_close(conn_t *c) {
+    if (c->cfd >= 0)
+        close(c->cfd);
+    c->cfd = -1;
+    c->cl = CL_DONE;
+    c->cl_deadline = 0;
+    client_release(c);
+    free(c->in);
+    c->in = NULL;
+}
+
+static void client_next_request(conn_t *c) {
+    client_release(c);
+    // an idle keep-alive conn keeps its request buffer only for pipelined bytes
+    if (!http_reqbuf_pending(c->in)) {
+        free(c->in);
+        c->in = NULL;
+    }
+    c->cl = CL_READ_REQ;
+    c->cl_deadline = now_ms() + KEEPALIVE_IDLE_MS;
+    reactor_post(c->re, c);
+}
+
+static void client_reply(conn_t *c, const char *msg, size_t len) {
+    c->cl = CL_REPLY;
+    c->reply = msg;
+    c->reply_len = len;
+    c->reply_off = 0;
+}
+
+static void upstream_close(conn_t *c) {
+    if (c->ufd >= 0)
+        close(c->ufd);
+    c->ufd = -1;
+    c->up_deadline = 0;
+}
+
+static void upstream_finish(conn_t *c) {
+    if (c->ufd >= 0 && http_framer_done(&c->ub->fr) && c->ub->fr.keep_alive) {
+        epoll_ctl(c->re->epfd, EPOLL_CTL_DEL, c->ufd, NULL);
+        upool_put(&c->re->px->upool, c->req.host, c->req.port, c->ufd);
+        c->ufd = -1;
+    }
+    upstream_close(c);
+    free(c->ub);
+    c->ub = NULL;
+    c->up = UP_DONE;
+    rec_finish(&c->re->px->cache, c->up_rec);
+    cache_release(c->up_rec);
+    c->up_rec = NULL;
+}
+
+static void upstream_fail(conn_t *c, const char *msg, size_t len) {
+    upstream_close(c);
+    free(c->ub);
+    c->ub = NULL;
+    c->up = UP_DONE;
+    if (msg && c->cl == CL_STREAM && c->rec == c->up_rec && c->rx == 0) {
+        client_release(c);
+        client_reply(c, msg, len);
+    }
+    rec_cancel(&c->re->px->cache, c->up_rec);
+    cache_release(c->up_rec);
+    c->up_rec = NULL;
+}
+
+static int upstream_attach(conn_t *c, int fd) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &c->uev;
+    if (epoll_ctl(c->re->epfd, EPOLL_CTL_ADD, fd, &ev))
+        return -1;
+    c->ufd = fd;
+    c->up_events = 0;
+    return 0;
+}
+
+static void start_connect(conn_t *c) {
+    while (c->ai_next) {
+        const struct addrinfo *ai = c->ai_next;
+        c->ai_next = ai->ai_next;
+
+        int fd = net_connect_start(ai);
+        if (fd < 0)
+            continue;
+        if (upstream_attach(c, fd)) {
+            close(fd);
+            continue;
+        }
+
+        c->up = UP_CONNECTING;
+        c->up_deadline = now_ms() + CONNECT_TIMEOUT_MS;
+        return;
+    }
+    upstream_fail(c, BAD_GATEWAY, sizeof BAD_GATEWAY - 1);
+}
+
+static void resolve_job(void *arg) {
+    conn_t *c = (conn_t *) arg;
+    c->resolve_rc = net_resolve(c->req.host, c->req.port, &c->ai);
+    atomic_store(&c->resolved, 1);
+    reactor_post(c->re, c);
+    atomic_store(&c->resolved, 2);
+}
+
+/* A lookup that timed out keeps running on the worker; until it lets go
+   the conn can neither start another one nor be freed. */
+static void start_resolve(conn_t *c) {
+    if (c->resolve_out && !atomic_load(&c->resolved)) {
+        upstream_fail(c, BAD_GATEWAY, sizeof BAD_GATEWAY - 1);
+        return;
+    }
+    if (c->ai)
+        freeaddrinfo(c->ai);
+    c->ai = c->ai_next = NULL;
+    atomic_store(&c->resolved, 0);
+    c->resolve_out = 1;
+    c->up = UP_RESOLVING;
+    c->up_deadline = now_ms() + RESOLVE_TIMEOUT_MS;
+    tp_submit(&c->re->sh->tp, resolve_job, c);
+}
+
+static void start_upstream(conn_t *c) {
+    int fd = upool_get(&c->re->px->upool, c->req.host, c->req.port);
+    c->up_reused = 0;
+    c->upreq_off = 0;
+    if (fd >= 0 && set_nonblock(fd) == 0 && upstream_attach(c, fd) == 0) {
+        c->up_reused = 1;
+        c->up = UP_SENDING;
+        c->up_deadline = now_ms() + IDLE_RW_MS;
+        reactor_post(c->re, c);
+        return;
+    }
+    if (fd >= 0)
+        close(fd);
+    start_resolve(c);
+}
+
+static int store_chunk(void *arg, const void *buf, size_t len) {
+    conn_t *c = (conn_t *) arg;
+    if (c->ub->fr.expect >= 0)
+        rec_declare_length(c->up_rec, (size_t) c->ub->fr.expect);
+    if (c->ub->fr.bypass && !rec_size(c->up_rec))
+        rec_forget(&c->re->px->cache, c->up_rec);
+    return rec_append(&c->re->px->cache, c->up_rec, buf, len);
+}
+
+static void upstream_eof(conn_t *c) {
+    if (http_framer_eof(&c->ub->fr, store_chunk, c))
+        upstream_fail(c, NULL, 0);
+    else
+        upstream_finish(c);
+}
+
+static void start_request(conn_t *c) {
+    proxy_ctx_t *px = c->re->px;
+
+    cache_key_t key = { c->req.origin, c->req.origin_len, c->req.path.p, c->req.path.len, c->req.key_hash };
+    cache_acquire_t acq = (cache_acquire_t) {0};
+    c->rw = malloc(sizeof *c->rw);
+    if (!c->rw || cache_acquire(&px->cache, &key, &acq)) {
+        client_close(c);
+        return;
+    }
+    c->rec = acq.rec;
+    c->cl = CL_STREAM;
+    c->cl_deadline = 0;
+    resp_init(c->rw, c->req.keep_alive, c->req.http11);
+    rec_cursor_attach(c->rec, &c->rw->cur);
+
+    if (acq.is_fetcher) {
+        log_info("MISS+FETCH %s", rec_key(c->rec));
+        if (stop_flag || !(c->ub = malloc(sizeof *c->ub))) {
+            rec_cancel(&px->cache, c->rec);
+            return;
+        }
+        cache_retain(c->rec);
+        c->up_rec = c->rec;
+        c->rx = 0;
+        c->upreq_len = (size_t) http_build_upstream_get(c->ub->req, sizeof c->ub->req, &c->req);
+        http_framer_init(&c->ub->fr);
+        c->ub->no_pass = c->ub->held = 0;
+        start_upstream(c);
+    } else {
+        if (rec_is_completed(c->rec)) {
+            log_info("HIT %s", rec_key(c->rec));
+            rec_touch(&px->cache, c->rec);
+        } else {
+            log_info("JOIN %s", rec_key(c->rec));
+        }
+    }
+}
+
+static void client_read(conn_t *c) {
+    if (!c->in) {
+        if (!(c->in = malloc(sizeof *c->in))) {
+            client_close(c);
+            return;
+        }
+        http_reqbuf_init(c->in);
+    }
+
+    int rc;
+    while ((rc = http_reqbuf_parse(c->in, &c->req)) == 0 && !c->in->eof) {
+        ssize_t n = http_reqbuf_fill(c->in, c->cfd);
+        if (n > 0) {
+            c->cl_deadline = now_ms() + IDLE_RW_MS;
+            continue;
+        }
+        if (n == 0)
+            break;
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        client_close(c);
+        return;
+    }
+
+    if (rc == 0) {
+        client_close(c);
+        return;
+    }
+    if (rc < 0) {
+        client_reply(c, BAD_REQUEST, sizeof BAD_REQUEST - 1);
+        return;
+    }
+    start_request(c);
+}
+
+static void client_send(conn_t *c) {
+    for (int i = 0; i < REACTOR_IO_BUDGET; i++) {
+        const void *ptr = NULL;
+        size_t len = 0;
+
+        if (c->cl == CL_REPLY) {
+            if (c->reply_off == c->reply_len) {
+                client_close(c);
+                return;
+            }
+            ptr = c->reply + c->reply_off;
+            len = c->reply_len - c->reply_off;
+        } else {
+            int rc = resp_next(c->rw, c->rec, &ptr, &len, &c->w);
+            if (rc == RESP_DONE && c->rw->keep_alive && !stop_flag) {
+                client_next_request(c);
+                return;
+            }
+            if (rc == RESP_DONE || rc == RESP_ERROR) {
+                client_close(c);
+                return;
+            }
+            if (rc == RESP_WAIT) {
+                c->cl_deadline = 0;
+                // our own fetch was held for a pass until we caught up
+                if (c->ub && c->ub->held)
+                    reactor_post(c->re, c);
+                return;
+            }
+        }
+
+        int rfd = c->cl != CL_REPLY && resp_pending_body(c->rw) ? rec_file(c->rec) : -1;
+        off_t o = c->cl != CL_REPLY ? (off_t) c->rw->off : 0;
+        ssize_t w = rfd >= 0 ? sendfile(c->cfd, rfd, &o, len) : send(c->cfd, ptr, len, MSG_NOSIGNAL);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!c->cl_deadline)
+                    c->cl_deadline = now_ms() + IDLE_RW_MS;
+                return;
+            }
+            client_close(c);
+            return;
+        }
+        if (c->cl == CL_REPLY)
+            c->reply_off += (size_t) w;
+        else {
+            resp_consumed(c->rw, (size_t) w);
+            rec_cursor_move(c->rec, &c->rw->cur, c->rw->off);
+        }
+        c->cl_deadline = 0;
+    }
+    reactor_post(c->re, c);
+}
+
+/* With nobody joined and the client caught up, the rest of a bypassed
+   body goes from upstream to the client through a pipe and the record
+   ends short; the client's writer is told what went past it. Returns 1
+   to hold upstream until the client has sent what the record holds. */
+static int start_pass(conn_t *c, size_t left) {
+    up_buf_t *ub = c->ub;
+    int plain = c->rec == c->up_rec && c->rw ? resp_plain_body(c->rw) : -1;
+    if (plain < 0) {
+        ub->no_pass = 1;
+        return -1;
+    }
+    ub->held = !resp_passthrough(c->rw) || c->rw->off != rec_size(c->up_rec);
+    if (ub->held)
+        return 1;
+    if (pipe2(ub->pipe, O_NONBLOCK | O_CLOEXEC)) {
+        ub->no_pass = 1;
+        return -1;
+    }
+    rec_cursor_can_take(&c->rw->cur, 1);
+    if (rec_pass(&c->re->px->cache, c->up_rec, c->ufd, left, ub->fr.keep_alive)) {
+        close(ub->pipe[0]);
+        close(ub->pipe[1]);
+        ub->no_pass = 1;
+        return -1;
+    }
+    (void) rec_take_pass(c->up_rec, &ub->left, &ub->reuse);
+    ub->queued = 0;
+    rec_finish(&c->re->px->cache, c->up_rec);
+    c->up = UP_PASS;
+    c->up_deadline = now_ms() + IDLE_RW_MS;
+    return 0;
+}
+
+static void pass_end(conn_t *c, int ok) {
+    up_buf_t *ub = c->ub;
+    close(ub->pipe[0]);
+    close(ub->pipe[1]);
+    if (ok && ub->reuse) {
+        epoll_ctl(c->re->epfd, EPOLL_CTL_DEL, c->ufd, NULL);
+        upool_put(&c->re->px->upool, c->req.host, c->req.port, c->ufd);
+        c->ufd = -1;
+    }
+    upstream_close(c);
+    free(ub);
+    c->ub = NULL;
+    c->up = UP_DONE;
+    cache_release(c->up_rec);
+    c->up_rec = NULL;
+    if (ok)
+        reactor_post(c->re, c);
+    else
+        client_close(c);
+}
+
+// both ends are non-blocking; either one's readiness brings us back
+static void pass_step(conn_t *c) {
+    up_buf_t *ub = c->ub;
+    for (int i = 0; i < REACTOR_IO_BUDGET; i++) {
+        if (stop_flag || c->cl != CL_STREAM) {
+            pass_end(c, 0);
+            return;
+        }
+        ssize_t n;
+        if (ub->queued) {
+            n = splice(ub->pipe[0], NULL, c->cfd, NULL, ub->queued, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                ub->queued -= (size_t) n;
+                resp_delivered(c->rw, (size_t) n);
+            }
+        } else if (ub->left) {
+            n = splice(c->ufd, NULL, ub->pipe[1], NULL, ub->left < BLOCK_SZ ? ub->left : BLOCK_SZ,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                ub->queued += (size_t) n;
+                ub->left -= (size_t) n;
+            }
+        } else {
+            pass_end(c, 1);
+            return;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            pass_end(c, 0);
+            return;
+        }
+        c->up_deadline = now_ms() + IDLE_RW_MS;
+    }
+    reactor_post(c->re, c);
+}
+
+static void upstream_step(conn_t *c) {
+    if (c->up == UP_PASS) {
+        pass_step(c);
+        return;
+    }
+
+    if (c->up == UP_RESOLVING) {
+        if (!atomic_load(&c->resolved))
+            return;
+        if (c->resolve_rc) {
+            upstream_fail(c, BAD_GATEWAY, sizeof BAD_GATEWAY - 1);
+            return;
+        }
+        c->ai_next = c->ai;
+        start_connect(c);
+        return;
+    }
+
+    if (c->up == UP_CONNECTING) {
+        if (!c->up_events)
+            return;
+        int err = 0;
+        socklen_t el = sizeof err;
+        if (getsockopt(c->ufd, SOL_SOCKET, SO_ERROR, &err, &el) || err) {
+            upstream_close(c);
+            start_connect(c);
+            return;
+        }
+        c->up = UP_SENDING;
+        c->up_deadline = now_ms() + IDLE_RW_MS;
+    }
+
+    if (c->up == UP_SENDING) {
+        while (c->upreq_off < c->upreq_len) {
+            ssize_t w = send(c->ufd, c->ub->req + c->upreq_off, c->upreq_len - c->upreq_off, MSG_NOSIGNAL);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return;
+                if (c->up_reused) {
+                    upstream_close(c);
+                    start_upstream(c);
+                    return;
+                }
+                upstream_fail(c, BAD_GATEWAY, sizeof BAD_GATEWAY - 1);
+                return;
+            }
+            c->upreq_off += (size_t) w;
+        }
+        c->up = UP_RECV;
+        c->up_deadline = now_ms() + FIRST_BYTE_MS;
+    }
+
+    if (c->up != UP_RECV)
+        return;
+
+    for (int i = 0; i < REACTOR_IO_BUDGET; i++) {
+        if (stop_flag) {
+            upstream_fail(c, NULL, 0);
+            return;
+        }
+
+        // paused while the slowest reader is a window behind; it reposts us
+        int win = rec_window(&c->re->px->cache, c->up_rec, &c->uw);
+        if (win < 0) {
+            upstream_fail(c, NULL, 0);
+            return;
+        }
+        if (win > 0) {
+            c->up_deadline = 0;
+            return;
+        }
+        if (!c->up_deadline)
+            c->up_deadline = now_ms() + IDLE_RW_MS;
+
+        char *dst = c->re->buf;
+        size_t cap = http_framer_direct(&c->ub->fr);
+        if (cap && c->ub->fr.bypass && c->ub->fr.expect >= 0 && !c->ub->no_pass) {
+            int rc = start_pass(c, cap);
+            if (rc == 0)
+                pass_step(c);
+            else if (rc > 0)
+                c->up_deadline = 0;
+            if (rc >= 0)
+                return;
+        }
+        if (cap)
+            dst = rec_reserve(&c->re->px->cache, c->up_rec, &cap);
+        else
+            cap = BLOCK_SZ;
+        if (!dst) {
+            upstream_fail(c, NULL, 0);
+            return;
+        }
+
+        ssize_t n = recv(c->ufd, dst, cap, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            rec_flush(c->up_rec);
+            return;
+        }
+        if (c->rx == 0 && c->up_reused && (n == 0 || (n < 0 && (errno == ECONNRESET || errno == EPIPE)))) {
+            upstream_close(c);
+            start_upstream(c);
+            return;
+        }
+        if (n == 0) {
+            upstream_eof(c);
+            return;
+        }
+        if (n < 0) {
+            if (c->rx > 0)
+                upstream_eof(c);
+            else
+                upstream_fail(c, BAD_GATEWAY, sizeof BAD_GATEWAY - 1);
+            return;
+        }
+
+        c->rx += (size_t) n;
+        c->up_deadline = now_ms() + IDLE_RW_MS;
+        int fr;
+        if (dst == c->re->buf)
+            fr = http_framer_feed(&c->ub->fr, dst, (size_t) n, store_chunk, c);
+        else
+            fr = rec_commit(c->up_rec, (size_t) n) ? -1 : http_framer_direct_done(&c->ub->fr, (size_t) n);
+        if (fr < 0) {
+            upstream_fail(c, NULL, 0);
+            return;
+        }
+        if (fr == 1) {
+            upstream_finish(c);
+            return;
+        }
+    }
+    reactor_post(c->re, c);
+}
+
+static void conn_kill(conn_t *c) {
+    reactor_t *re = c->re;
+
+    c->dead = 1;
+    client_close(c);
+    if (c->up == UP_PASS)
+        pass_end(c, 0);
+    else if (c->up != UP_NONE && c->up != UP_DONE)
+        upstream_fail(c, NULL, 0);
+    inbox_unlink(re, c);
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        re->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    c->next = re->dead;
+    re->dead = c;
+    atomic_fetch_sub(&re->nconns, 1);
+}
+
+static void conn_run(conn_t *c) {
+    if (c->dead)
+        return;
+
+    if (!c->adopted) {
+        reactor_t *re = c->re;
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = &c->cev;
+        c->adopted = 1;
+        atomic_fetch_add(&re->nconns, 1);
+        c->prev = NULL;
+        c->next = re->conns;
+        if (re->conns)
+            re->conns->prev = c;
+        re->conns = c;
+        if (epoll_ctl(re->epfd, EPOLL_CTL_ADD, c->cfd, &ev)) {
+            conn_kill(c);
+            return;
+        }
+    }
+
+    if (c->up != UP_NONE && c->up != UP_DONE)
+        upstream_step(c);
+    if (c->cl == CL_READ_REQ && (c->up == UP_NONE || c->up == UP_DONE))
+        client_read(c);
+    if (c->cl == CL_STREAM || c->cl == CL_REPLY)
+        client_send(c);
+
+    if (c->cl == CL_DONE && (c->up == UP_NONE || c->up == UP_DONE))
+        conn_kill(c);
+}
+
+static void sweep(reactor_t *re, uint64_t now) {
+    conn_t *n;
+    for (conn_t *c = re->conns; c; c = n) {
+        n = c->next;
+        int fired = 0;
+
+        if (c->up_deadline && now >= c->up_deadline) {
+            fired = 1;
+            c->up_deadline = 0;
+            if (c->up == UP_RESOLVING) {
+                upstream_fail(c, GATEWAY_TIMEOUT, sizeof GATEWAY_TIMEOUT - 1);
+            } else if (c->up == UP_PASS) {
+                pass_end(c, 0);
+            } else if (c->up == UP_CONNECTING) {
+                upstream_close(c);
+                start_connect(c);
+            } else if (c->up == UP_RECV && c->rx > 0) {
+                upstream_eof(c);
+            } else if (c->up == UP_RECV) {
+                upstream_fail(c, GATEWAY_TIMEOUT, sizeof GATEWAY_TIMEOUT - 1);
+            } else if (c->up == UP_SENDING) {
+                upstream_fail(c, BAD_GATEWAY, sizeof BAD_GATEWAY - 1);
+            }
+        }
+        if (c->cl_deadline && now >= c->cl_deadline) {
+            fired = 1;
+            client_close(c);
+        }
+        if (fired)
+            conn_run(c);
+    }
+}
+
+static void reap(reactor_t *re) {
+    conn_t **pp = &re->dead;
+    while (*pp) {
+        conn_t *c = *pp;
+        if (c->resolve_out && atomic_load(&c->resolved) != 2) {
+            pp = &c->next;
+            continue;
+        }
+        *pp = c->next;
+        inbox_unlink(re, c);
+        if (c->ai)
+            freeaddrinfo(c->ai);
+        free(c->in);
+        free(c->rw);
+        free(c->ub);
+        free(c);
+    }
+}
+
+static void drain_inbox(reactor_t *re) {
+    pthread_mutex_lock(&re->inbox_m);
+    conn_t *list = re->inbox;
+    re->inbox = NULL;
+    pthread_mutex_unlock(&re->inbox_m);
+
+    while (list) {
+        conn_t *c = list;
+        pthread_mutex_lock(&re->inbox_m);
+        list = c->inbox_next;
+        c->inbox_next = NULL;
+        c->in_inbox = 0;
+        pthread_mutex_unlock(&re->inbox_m);
+        conn_run(c);
+    }
+}
+
+static conn_t *conn_new(reactor_t *re, int fd) {
+    conn_t *c = calloc(1, sizeof *c);
+    if (!c)
+        return NULL;
+
+    c->re = re;
+    c->cfd = fd;
+    c->ufd = -1;
+    c->cl = CL_READ_REQ;
+    c->up = UP_NONE;
+    c->cev.c = c;
+    c->cev.which = SRC_CLIENT;
+    c->uev.c = c;
+    c->uev.which = SRC_UPSTREAM;
+    c->w.wake = on_record_update;
+    c->uw.wake = on_window_open;
+    atomic_init(&c->resolved, 0);
+    c->cl_deadline = now_ms() + IDLE_RW_MS;
+    return c;
+}
+
+static void accept_ready(reactor_t *re) {
+    shard_t *sh = re->sh;
+    while (1) {
+        int fd = accept4(sh->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (!stop_flag)
+                log_err("accept: %s", strerror(errno));
+            epoll_ctl(re->epfd, EPOLL_CTL_DEL, sh->listen_fd, NULL);
+            return;
+        }
+
+        atomic_fetch_add(&sh->accepted, 1);
+        conn_t *c = conn_new(re, fd);
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        conn_run(c);
+    }
+}
+
+static void *reactor_main(void *arg) {
+    reactor_t *re = (reactor_t *) arg;
+    struct epoll_event evs[EPOLL_BATCH];
+    uint64_t next_sweep = now_ms() + SWEEP_INTERVAL_MS;
+
+    while (!atomic_load(&re->stop)) {
+        int n = epoll_wait(re->epfd, evs, EPOLL_BATCH, SWEEP_INTERVAL_MS);
+        if (n < 0 && errno != EINTR) {
+            log_err("epoll_wait: %s", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.ptr == re) {
+                accept_ready(re);
+                continue;
+            }
+            ev_src_t *src = (ev_src_t *) evs[i].data.ptr;
+            if (!src) {
+                uint64_t cnt;
+                ssize_t r = read(re->evfd, &cnt, sizeof cnt);
+                (void) r;
+                continue;
+            }
+            if (src->which == SRC_UPSTREAM)
+                src->c->up_events |= evs[i].events;
+            conn_run(src->c);
+        }
+
+        drain_inbox(re);
+
+        uint64_t now = now_ms();
+        if (now >= next_sweep) {
+            sweep(re, now);
+            next_sweep = now + SWEEP_INTERVAL_MS;
+        }
+        reap(re);
+    }
+
+    drain_inbox(re);
+    while (re->conns)
+        conn_kill(re->conns);
+    reap(re);
+    return NULL;
+}
+
+int reactor_init(reactor_t *re, struct proxy_ctx *px, struct shard *sh) {
+    memset(re, 0, sizeof *re);
+    re->px = px;
+    re->sh = sh;
+    atomic_init(&re->nconns, 0);
+    re->epfd = re->evfd = -1;
+    atomic_init(&re->stop, 0);
+    pthread_mutex_init(&re->inbox_m, NULL);
+
+    re->buf = malloc(BLOCK_SZ);
+    re->epfd = epoll_create1(EPOLL_CLOEXEC);
+    re->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!re->buf || re->epfd < 0 || re->evfd < 0) {
+        reactor_destroy(re);
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(re->epfd, EPOLL_CTL_ADD, re->evfd, &ev)) {
+        reactor_destroy(re);
+        return -1;
+    }
+
+    if (sh && sh->listen_fd >= 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = re;
+        if (set_nonblock(sh->listen_fd) || epoll_ctl(re->epfd, EPOLL_CTL_ADD, sh->listen_fd, &ev)) {
+            reactor_destroy(re);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int reactor_start(reactor_t *re) {
+    return pthread_create(&re->th, NULL, reactor_main, re) ? -1 : 0;
+}
+
+void reactor_stop_and_join(reactor_t *re) {
+    atomic_store(&re->stop, 1);
+    uint64_t one = 1;
+    ssize_t w = write(re->evfd, &one, sizeof one);
+    (void) w;
+    pthread_join(re->th, NULL);
+}
+
+void reactor_destroy(reactor_t *re) {
+    if (re->evfd >= 0)
+        close(re->evfd);
+    if (re->epfd >= 0)
+        close(re->epfd);
+    free(re->buf);
+    pthread_mutex_destroy(&re->inbox_m);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <pthread.h>
+#include <stdatomic.h>
+
+struct proxy_ctx;
+struct shard;
+struct conn;
+
+typedef struct reactor {
+    int epfd;
+    int evfd;
+    pthread_t th;
+    struct proxy_ctx *px;
+    struct shard *sh;
+    atomic_int stop;
+    atomic_int nconns;
+
+    pthread_mutex_t inbox_m;
+    struct conn *inbox;
+
+    struct conn *conns;
+    struct conn *dead;
+    char *buf;
+} reactor_t;
+
+int  reactor_init(reactor_t *re, struct proxy_ctx *px, struct shard *sh);
+int  reactor_start(reactor_t *re);
+void reactor_stop_and_join(reactor_t *re);
+void reactor_destroy(reactor_t *re);
@@ -0,0 +1,219 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "resp.h"
+#include "http.h"
+#include "hscan.h"
+
+enum { PH_HEAD, PH_BODY, PH_END, PH_FIN };
+
+void resp_init(resp_writer_t *w, int client_keep_alive, int client_http11) {
+    memset(w, 0, sizeof *w);
+    w->client_keep_alive = client_keep_alive;
+    w->client_http11 = client_http11;
+    w->phase = PH_HEAD;
+    w->remaining = -1;
+}
+
+static void set_pend(resp_writer_t *w, const char *p, size_t n, int body, int meta) {
+    w->pend = p;
+    w->pend_len = n;
+    w->pend_body = body;
+    w->pend_meta = meta;
+}
+
+static const char *find_head_end(const char *buf, size_t from, size_t to) {
+    size_t i = from >= 3 ? from - 3 : 0;
+    return hscan_head_end(buf + i, to - i);
+}
+
+static void start_raw(resp_writer_t *w) {
+    w->raw = 1;
+    w->remaining = -1;
+    w->phase = PH_BODY;
+    set_pend(w, w->head, w->head_have, 0, 0);
+}
+
+static void start_body(resp_writer_t *w, record_t *r, size_t head_len) {
+    http_response_t rsp;
+    if (http_parse_response_head(w->head, head_len, &rsp) || rsp.chunked) {
+        start_raw(w);
+        return;
+    }
+
+    long long cl = -1;
+    if (rsp.no_body)
+        cl = 0;
+    else if (rsp.content_length >= 0)
+        cl = rsp.content_length;
+    else if (rec_is_completed(r))
+        cl = (long long) (rec_size(r) - head_len);
+
+    int chunked = cl < 0 && w->client_keep_alive && w->client_http11;
+    int keep = w->client_keep_alive && (cl >= 0 || chunked);
+    int n = http_rewrite_response_head(w->hout, sizeof w->hout, w->head, head_len,
+                                       rsp.no_body ? -1 : cl, chunked, keep);
+    if (n < 0) {
+        start_raw(w);
+        return;
+    }
+
+    w->chunked = chunked;
+    w->remaining = cl;
+    w->keep_alive = keep;
+    w->phase = PH_BODY;
+    set_pend(w, w->hout, (size_t) n, 0, 0);
+}
+
+static int next_head(resp_writer_t *w, record_t *r, rec_waiter_t *wt) {
+    while (1) {
+        const void *ptr;
+        size_t len;
+        int done, canceled;
+        size_t off = w->off;
+        rec_poll_chunk(r, &off, &ptr, &len, &done, &canceled, wt);
+        if (canceled)
+            return RESP_ERROR;
+        if (!len) {
+            if (!done)
+                return RESP_WAIT;
+            if (!w->head_have) {
+                w->phase = PH_FIN;
+                return RESP_DONE;
+            }
+            start_raw(w);
+            return RESP_MORE;
+        }
+
+        size_t room = sizeof w->head - w->head_have;
+        size_t take = len < room ? len : room;
+        memcpy(w->head + w->head_have, ptr, take);
+        const char *e = find_head_end(w->head, w->head_have, w->head_have + take);
+        if (e) {
+            size_t head_len = (size_t) (e - w->head);
+            w->off = off + (head_len - w->head_have);
+            w->head_have = head_len;
+            start_body(w, r, head_len);
+            return RESP_MORE;
+        }
+        w->head_have += take;
+        w->off = off + take;
+        if (w->head_have == sizeof w->head) {
+            start_raw(w);
+            return RESP_MORE;
+        }
+    }
+}
+
+static int next_body(resp_writer_t *w, record_t *r, rec_waiter_t *wt) {
+    if (w->remaining == 0) {
+        w->phase = PH_END;
+        return -1;
+    }
+
+    const void *ptr;
+    size_t len;
+    int done, canceled;
+    size_t off = w->off;
+    rec_poll_chunk(r, &off, &ptr, &len, &done, &canceled, wt);
+    if (canceled)
+        return RESP_ERROR;
+    if (!len) {
+        // a passed record finishes short; the rest comes from rec_take_pass
+        if (!done || rec_passing(r))
+            return RESP_WAIT;
+        w->phase = PH_END;
+        return -1;
+    }
+    w->off = off;
+
+    if (w->remaining > 0 && (long long) len > w->remaining)
+        len = (size_t) w->remaining;
+
+    if (w->chunked && !w->chunk_left) {
+        int n = snprintf(w->meta, sizeof w->meta, "%s%zx\r\n", w->nchunks ? "\r\n" : "", len);
+        w->nchunks++;
+        w->chunk_left = len;
+        set_pend(w, w->meta, (size_t) n, 0, 1);
+        return RESP_MORE;
+    }
+    if (w->chunked && len > w->chunk_left)
+        len = w->chunk_left;
+
+    set_pend(w, (const char *) ptr, len, 1, 0);
+    return RESP_MORE;
+}
+
+int resp_next(resp_writer_t *w, record_t *r, const void **ptr, size_t *len, rec_waiter_t *wt) {
+    while (!w->pend_len) {
+        int rc;
+        switch (w->phase) {
+        case PH_HEAD:
+            rc = next_head(w, r, wt);
+            if (rc != RESP_MORE)
+                return rc;
+            break;
+        case PH_BODY:
+            rc = next_body(w, r, wt);
+            if (rc >= 0 && rc != RESP_MORE)
+                return rc;
+            break;
+        case PH_END:
+            w->phase = PH_FIN;
+            if (w->raw || w->remaining > 0)
+                w->keep_alive = 0;
+            if (w->chunked) {
+                int n = snprintf(w->meta, sizeof w->meta, "%s0\r\n\r\n", w->nchunks ? "\r\n" : "");
+                set_pend(w, w->meta, (size_t) n, 0, 1);
+            }
+            break;
+        default:
+            return RESP_DONE;
+        }
+    }
+
+    *ptr = w->pend;
+    *len = w->pend_len;
+    return RESP_MORE;
+}
+
+void resp_consumed(resp_writer_t *w, size_t n) {
+    w->pend += n;
+    w->pend_len -= n;
+    if (w->pend_body) {
+        w->off += n;
+        if (w->remaining > 0)
+            w->remaining -= (long long) n;
+        if (w->chunk_left)
+            w->chunk_left -= n;
+    }
+}
+
+int resp_pending_meta(const resp_writer_t *w) {
+    return w->pend_len && w->pend_meta;
+}
+
+/* Nothing is pending and body bytes go out exactly as stored, so the
+   client could be fed from elsewhere; resp_delivered() accounts for it. */
+int resp_passthrough(const resp_writer_t *w) {
+    return w->phase == PH_BODY && !w->chunked && !w->raw && !w->pend_len;
+}
+
+/* 0 while the head is still coming, then 1 if body bytes go out exactly
+   as stored and -1 if not. */
+int resp_plain_body(const resp_writer_t *w) {
+    if (w->phase == PH_HEAD)
+        return 0;
+    return !w->chunked && !w->raw ? 1 : -1;
+}
+
+void resp_delivered(resp_writer_t *w, size_t n) {
+    w->off += n;
+    if (w->remaining > 0)
+        w->remaining -= (long long) n;
+}
+
+/* Pending bytes are the record's own, starting at offset w->off. */
+int resp_pending_body(const resp_writer_t *w) {
+    return w->pend_len && w->pend_body;
+}
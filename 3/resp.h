@@ -0,0 +1,43 @@
+#pragma once
+#include <stddef.h>
+
+#include "cache.h"
+#include "config.h"
+
+enum { RESP_WAIT, RESP_MORE, RESP_DONE, RESP_ERROR };
+
+typedef struct {
+    int client_keep_alive;
+    int client_http11;
+
+    int phase;
+    size_t off;
+
+    char head[RESP_HEAD_MAX];
+    size_t head_have;
+    char hout[RESP_HEAD_MAX + 256];
+
+    int chunked;
+    int raw;
+    long long remaining;
+    size_t chunk_left;
+    int nchunks;
+    char meta[32];
+
+    const char *pend;
+    size_t pend_len;
+    int pend_body;
+    int pend_meta;
+
+    int keep_alive;
+    rec_cursor_t cur;
+} resp_writer_t;
+
+void resp_init(resp_writer_t *w, int client_keep_alive, int client_http11);
+int  resp_next(resp_writer_t *w, record_t *r, const void **ptr, size_t *len, rec_waiter_t *wt);
+void resp_consumed(resp_writer_t *w, size_t n);
+int  resp_pending_meta(const resp_writer_t *w);
+int  resp_pending_body(const resp_writer_t *w);
+int  resp_passthrough(const resp_writer_t *w);
+int  resp_plain_body(const resp_writer_t *w);
+void resp_delivered(resp_writer_t *w, size_t n);
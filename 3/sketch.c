@@ -0,0 +1,72 @@
+#include <stdlib.h>
+
+#include "sketch.h"
+
+#define SKETCH_MAX 15
+
+static const uint64_t seeds[SKETCH_ROWS] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+};
+
+static size_t slot(const sketch_t *s, uint64_t h, int row) {
+    uint64_t x = (h ^ (h >> 29)) * seeds[row];
+    return (size_t) row * s->width + (size_t) ((x >> 32) & (s->width - 1));
+}
+
+int sketch_init(sketch_t *s, size_t width) {
+    if ((width & (width - 1)) != 0)
+        return -1;
+    s->t = calloc(SKETCH_ROWS * width, 1);
+    if (!s->t)
+        return -1;
+    s->width = width;
+    s->adds = 0;
+    s->sample = width * 10;
+    return 0;
+}
+
+void sketch_destroy(sketch_t *s) {
+    free(s->t);
+    s->t = NULL;
+}
+
+/* Halving every counter once per sample keeps the sketch a picture of
+   recent popularity rather than all-time counts. Racing adds may lose an
+   increment here and there, which a sketch can afford. */
+static void sketch_age(sketch_t *s) {
+    for (size_t i = 0; i < SKETCH_ROWS * s->width; i++) {
+        uint8_t v = __atomic_load_n(&s->t[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&s->t[i], v >> 1, __ATOMIC_RELAXED);
+    }
+}
+
+void sketch_add(sketch_t *s, uint64_t h) {
+    size_t at[SKETCH_ROWS];
+    int min = SKETCH_MAX;
+    for (int i = 0; i < SKETCH_ROWS; i++) {
+        at[i] = slot(s, h, i);
+        int v = __atomic_load_n(&s->t[at[i]], __ATOMIC_RELAXED);
+        if (v < min)
+            min = v;
+    }
+    if (min == SKETCH_MAX)
+        return;
+    // conservative update: only the counters holding the estimate grow
+    for (int i = 0; i < SKETCH_ROWS; i++)
+        if (__atomic_load_n(&s->t[at[i]], __ATOMIC_RELAXED) == min)
+            __atomic_store_n(&s->t[at[i]], (uint8_t) (min + 1), __ATOMIC_RELAXED);
+
+    if (__atomic_add_fetch(&s->adds, 1, __ATOMIC_RELAXED) % s->sample == 0)
+        sketch_age(s);
+}
+
+int sketch_freq(const sketch_t *s, uint64_t h) {
+    int min = SKETCH_MAX;
+    for (int i = 0; i < SKETCH_ROWS; i++) {
+        int v = __atomic_load_n(&s->t[slot(s, h, i)], __ATOMIC_RELAXED);
+        if (v < min)
+            min = v;
+    }
+    return min;
+}
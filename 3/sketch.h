@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define SKETCH_ROWS 4
+
+typedef struct sketch {
+    uint8_t *t;
+    size_t width;
+    size_t adds, sample;
+} sketch_t;
+
+int  sketch_init(sketch_t *s, size_t width);
+void sketch_destroy(sketch_t *s);
+
+void sketch_add(sketch_t *s, uint64_t h);
+int  sketch_freq(const sketch_t *s, uint64_t h);
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include "threadpool.h"
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -54,6 +56,14 @@ int jq_pop(job_queue_t *q, job_t *j) {
     return 0;
 }
 
+int jq_depth(job_queue_t *q) {
+    pthread_mutex_lock(&q->m);
+    int n = q->count;
+    pthread_mutex_unlock(&q->m);
+
+    return n;
+}
+
 static void* worker(void *arg) {
     threadpool_t *tp=(threadpool_t*)arg;
     while(1) {
@@ -110,3 +120,16 @@ void tp_poison_and_join(threadpool_t *tp) {
     for(int i = 0; i < tp->nworkers; i++)
         pthread_join(tp->th[i], NULL);
 }
+
+int tp_set_affinity(threadpool_t *tp, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    int rc = 0;
+    for(int i = 0; i < tp->nworkers; i++)
+        if(pthread_setaffinity_np(tp->th[i], sizeof set, &set))
+            rc = -1;
+
+    return rc;
+}
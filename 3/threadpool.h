@@ -28,8 +28,10 @@ int  jq_init(job_queue_t *q, int cap);
 void jq_destroy(job_queue_t *q);
 int  jq_push(job_queue_t *q, job_t j);
 int  jq_pop(job_queue_t *q, job_t *j);
+int  jq_depth(job_queue_t *q);
 
 int  tp_init(threadpool_t *tp, int nworkers, int qcap);
 void tp_destroy(threadpool_t *tp);
 int  tp_submit(threadpool_t *tp, job_fn fn, void *arg);
 void tp_poison_and_join(threadpool_t *tp);
+int  tp_set_affinity(threadpool_t *tp, int cpu);
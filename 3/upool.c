@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "upool.h"
+
+typedef struct upool_conn {
+    int fd;
+    uint64_t expires;
+    struct upool_conn *next;
+} upool_conn_t;
+
+typedef struct upool_host {
+    char host[256];
+    int port;
+    int nidle;
+    upool_conn_t *idle;
+    struct upool_host *next;
+} upool_host_t;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static size_t host_hash(const char *host, int port) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *) host; *p; ++p) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    h ^= (uint64_t) port;
+    h *= 1099511628211ULL;
+    return (size_t) h;
+}
+
+static struct upool_bucket *bucket_of(upool_t *p, const char *host, int port) {
+    return &p->b[host_hash(host, port) % p->nbuckets];
+}
+
+static upool_host_t *find_host(struct upool_bucket *b, const char *host, int port) {
+    for (upool_host_t *h = b->head; h; h = h->next)
+        if (h->port == port && strcmp(h->host, host) == 0)
+            return h;
+    return NULL;
+}
+
+/* An idle keep-alive socket must have nothing to read: data or EOF means
+   the origin closed it or sent something we never asked for. */
+static int conn_usable(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upool_init(upool_t *p, size_t nbuckets, int per_host, int idle_ms) {
+    memset(p, 0, sizeof *p);
+    p->b = calloc(nbuckets, sizeof *p->b);
+    if (!p->b)
+        return -1;
+    p->nbuckets = nbuckets;
+    p->per_host = per_host;
+    p->idle_ms = idle_ms;
+    for (size_t i = 0; i < nbuckets; i++)
+        pthread_mutex_init(&p->b[i].m, NULL);
+    return 0;
+}
+
+void upool_destroy(upool_t *p) {
+    for (size_t i = 0; i < p->nbuckets; i++) {
+        upool_host_t *h = p->b[i].head;
+        while (h) {
+            upool_host_t *hn = h->next;
+            for (upool_conn_t *uc = h->idle, *un; uc; uc = un) {
+                un = uc->next;
+                close(uc->fd);
+                free(uc);
+            }
+            free(h);
+            h = hn;
+        }
+        pthread_mutex_destroy(&p->b[i].m);
+    }
+    free(p->b);
+    p->b = NULL;
+}
+
+int upool_get(upool_t *p, const char *host, int port) {
+    struct upool_bucket *b = bucket_of(p, host, port);
+    uint64_t now = now_ms();
+    int fd = -1;
+
+    pthread_mutex_lock(&b->m);
+    upool_host_t *h = find_host(b, host, port);
+    while (h && h->idle && fd < 0) {
+        upool_conn_t *uc = h->idle;
+        h->idle = uc->next;
+        h->nidle--;
+        __atomic_fetch_sub(&p->idle, 1, __ATOMIC_RELAXED);
+        if (uc->expires > now && conn_usable(uc->fd))
+            fd = uc->fd;
+        else
+            close(uc->fd);
+        free(uc);
+    }
+    pthread_mutex_unlock(&b->m);
+
+    __atomic_fetch_add(fd >= 0 ? &p->reused : &p->missed, 1, __ATOMIC_RELAXED);
+    return fd;
+}
+
+void upool_put(upool_t *p, const char *host, int port, int fd) {
+    if (strlen(host) >= sizeof ((upool_host_t *) 0)->host) {
+        close(fd);
+        return;
+    }
+
+    upool_conn_t *uc = malloc(sizeof *uc);
+    if (!uc) {
+        close(fd);
+        return;
+    }
+    uc->fd = fd;
+    uc->expires = now_ms() + (uint64_t) p->idle_ms;
+
+    struct upool_bucket *b = bucket_of(p, host, port);
+    pthread_mutex_lock(&b->m);
+    upool_host_t *h = find_host(b, host, port);
+    if (!h && (h = calloc(1, sizeof *h))) {
+        strcpy(h->host, host);
+        h->port = port;
+        h->next = b->head;
+        b->head = h;
+    }
+    if (!h || h->nidle >= p->per_host) {
+        pthread_mutex_unlock(&b->m);
+        close(fd);
+        free(uc);
+        return;
+    }
+    uc->next = h->idle;
+    h->idle = uc;
+    h->nidle++;
+    pthread_mutex_unlock(&b->m);
+
+    __atomic_fetch_add(&p->parked, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->idle, 1, __ATOMIC_RELAXED);
+}
+
+void upool_reap(upool_t *p) {
+    uint64_t now = now_ms();
+    for (size_t i = 0; i < p->nbuckets; i++) {
+        struct upool_bucket *b = &p->b[i];
+        pthread_mutex_lock(&b->m);
+        upool_host_t **hp = &b->head;
+        while (*hp) {
+            upool_host_t *h = *hp;
+            upool_conn_t **cp = &h->idle;
+            while (*cp) {
+                upool_conn_t *uc = *cp;
+                if (uc->expires > now && conn_usable(uc->fd)) {
+                    cp = &uc->next;
+                    continue;
+                }
+                *cp = uc->next;
+                h->nidle--;
+                close(uc->fd);
+                free(uc);
+                __atomic_fetch_sub(&p->idle, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&p->reaped, 1, __ATOMIC_RELAXED);
+            }
+            if (!h->idle) {
+                *hp = h->next;
+                free(h);
+                continue;
+            }
+            hp = &h->next;
+        }
+        pthread_mutex_unlock(&b->m);
+    }
+}
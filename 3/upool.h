@@ -0,0 +1,23 @@
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct upool {
+    struct upool_bucket {
+        pthread_mutex_t m;
+        struct upool_host *head;
+    } *b;
+    size_t nbuckets;
+    int per_host;
+    int idle_ms;
+
+    volatile size_t reused, missed, parked, reaped, idle;
+} upool_t;
+
+int  upool_init(upool_t *p, size_t nbuckets, int per_host, int idle_ms);
+void upool_destroy(upool_t *p);
+
+int  upool_get(upool_t *p, const char *host, int port);
+void upool_put(upool_t *p, const char *host, int port, int fd);
+void upool_reap(upool_t *p);
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned nr) {
+    return (int) syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+int uring_init(uring_t *u, unsigned entries) {
+    memset(u, 0, sizeof *u);
+    u->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    int fd = sys_setup(entries, &p);
+    if (fd < 0)
+        return -1;
+    u->fd = fd;
+
+    u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED || u->sqes == MAP_FAILED) {
+        if (u->sq_ptr == MAP_FAILED)
+            u->sq_ptr = NULL;
+        if (u->cq_ptr == MAP_FAILED)
+            u->cq_ptr = NULL;
+        if (u->sqes == MAP_FAILED)
+            u->sqes = NULL;
+        uring_destroy(u);
+        return -1;
+    }
+
+    char *sq = (char *) u->sq_ptr;
+    char *cq = (char *) u->cq_ptr;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+
+    return 0;
+}
+
+void uring_destroy(uring_t *u) {
+    if (u->br)
+        munmap(u->br, u->br_sz);
+    free(u->bufs);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ptr)
+        munmap(u->cq_ptr, u->cq_sz);
+    if (u->sq_ptr)
+        munmap(u->sq_ptr, u->sq_sz);
+    if (u->fd >= 0)
+        close(u->fd);
+    u->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local_tail - head >= u->sq_entries)
+        return NULL;
+
+    unsigned idx = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+int uring_submit_wait(uring_t *u, unsigned wait_nr, int timeout_ms) {
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    void *argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof arg);
+        arg.ts = (unsigned long long) (uintptr_t) &ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof arg;
+    }
+
+    int rc = sys_enter(u->fd, u->to_submit, wait_nr, flags, argp, argsz);
+    if (rc < 0)
+        return -1;
+    u->to_submit -= (unsigned) rc < u->to_submit ? (unsigned) rc : u->to_submit;
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_setup_bufs(uring_t *u, unsigned nbufs, unsigned buf_sz) {
+    u->br_sz = nbufs * sizeof(struct io_uring_buf);
+    void *br = mmap(NULL, u->br_sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br == MAP_FAILED)
+        return -1;
+    u->br = (struct io_uring_buf_ring *) br;
+
+    u->bufs = malloc((size_t) nbufs * buf_sz);
+    if (!u->bufs)
+        return -1;
+    u->nbufs = nbufs;
+    u->buf_sz = buf_sz;
+    u->bgid = 0;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long long) (uintptr_t) u->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = u->bgid;
+    if (sys_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+        return -1;
+
+    u->br->tail = 0;
+    for (unsigned i = 0; i < nbufs; i++)
+        uring_buf_recycle(u, i);
+    return 0;
+}
+
+void *uring_buf(uring_t *u, unsigned bid) {
+    return u->bufs + (size_t) bid * u->buf_sz;
+}
+
+void uring_buf_recycle(uring_t *u, unsigned bid) {
+    unsigned short tail = u->br->tail;
+    struct io_uring_buf *b = &u->br->bufs[tail & (u->nbufs - 1)];
+    b->addr = (unsigned long long) (uintptr_t) uring_buf(u, bid);
+    b->len = u->buf_sz;
+    b->bid = (unsigned short) bid;
+    __atomic_store_n(&u->br->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long ud) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ud;
+}
+
+void uring_prep_recv_select(struct io_uring_sqe *sqe, int fd, unsigned short bgid, unsigned long long ud) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = ud;
+}
+
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long ud) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long) (uintptr_t) buf;
+    sqe->len = (unsigned) len;
+    sqe->user_data = ud;
+}
+
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, unsigned long long ud) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long) (uintptr_t) buf;
+    sqe->len = (unsigned) len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = ud;
+}
+
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, unsigned long long ud) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = ud;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+typedef struct uring {
+    int fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned to_submit;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz, sqes_sz;
+
+    struct io_uring_buf_ring *br;
+    size_t br_sz;
+    char *bufs;
+    unsigned nbufs, buf_sz;
+    unsigned short bgid;
+} uring_t;
+
+int  uring_init(uring_t *u, unsigned entries);
+void uring_destroy(uring_t *u);
+
+struct io_uring_sqe *uring_sqe(uring_t *u);
+int  uring_submit_wait(uring_t *u, unsigned wait_nr, int timeout_ms);
+struct io_uring_cqe *uring_peek(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+
+int  uring_setup_bufs(uring_t *u, unsigned nbufs, unsigned buf_sz);
+void *uring_buf(uring_t *u, unsigned bid);
+void uring_buf_recycle(uring_t *u, unsigned bid);
+
+void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, unsigned long long ud);
+void uring_prep_recv_select(struct io_uring_sqe *sqe, int fd, unsigned short bgid, unsigned long long ud);
+void uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, unsigned long long ud);
+void uring_prep_send(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, unsigned long long ud);
+void uring_prep_cancel_fd(struct io_uring_sqe *sqe, int fd, unsigned long long ud);